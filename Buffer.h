@@ -1,14 +1,15 @@
 #pragma once
 #include <cstdint>
 #include <memory>
-#include <atomic>
 
-/** Holds a work buffer, its metadata and synchonization elements */
+/** Holds a work buffer and its metadata. Ownership goes back and forth through the queues in PipeWriter. */
 struct Buffer {
-    char *data;                  //! The allocated data
-    uint32_t size;               //! Buffer capacity
-    uint32_t used;               //! Used amount so far
-    uint32_t index;              //! Indicates which thread owns this buffer
-    std::atomic<uint32_t> flag;  //! To synchronize between this owner and the main thread
+    char *data;      //! The allocated data
+    uint32_t size;   //! Buffer capacity
+    uint32_t used;   //! Used amount so far
+    uint32_t index;  //! Indicates which thread owns this buffer
+    bool eof;        //! Set on the chunk that ends the range, the writer stops after printing it
+    uint64_t seq;    //! Sequence number of the chunk in this buffer, the writer prints them in this order
+    uint64_t end;    //! Output offset right past this buffer, the pipe may reference it until read up to there
 };
 using BufferPtr = std::shared_ptr<Buffer>;
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <unistd.h>
+#include "NumericUtils.h"
+#include "Rules.h"
+
+/** Bytes of output a run has delivered, kept up to date by the writers so a checkpoint can be taken at any time */
+struct Progress {
+    std::atomic<uint64_t> delivered{0};  //! Bytes of this run accepted by the output, always a contiguous prefix
+    std::atomic<bool> stop{false};       //! Raised to end the run between two writes, never in the middle of one
+};
+
+/**
+ * Where the output of a run stopped, so a later run continues it byte-exact: the first line not
+ * fully delivered, how many of its bytes were, and what is left of the range. The generators of
+ * the resumed run simply seek to that line, as they do at the start of every chunk.
+ * Saved as a few "key value" lines, written aside and renamed so a crash never leaves half of one.
+ */
+class Checkpoint {
+public:
+    uint128_t line = 1;                                         //! First line not fully delivered
+    uint32_t skip = 0;                                          //! Bytes of that line already delivered
+    uint128_t to = UINT128MAX;                                  //! Last number of the range
+    uint64_t remaining = std::numeric_limits<uint64_t>::max();  //! Bytes left before the --bytes limit
+    uint64_t bytes = 0;                                         //! Bytes delivered by all the earlier runs
+    uint64_t layout = 0;                                        //! Rules::fingerprint() of the output
+    Progress progress;                                          //! Kept up to date by the writers of this run
+
+    /** Starts a run of the numbers line..last, cut after nbytes */
+    void start(uint128_t first, uint32_t cut, uint128_t last, uint64_t nbytes, const Rules &rules) {
+        line = first;
+        skip = cut;
+        to = last;
+        remaining = nbytes;
+        layout = rules.fingerprint();
+    }
+
+    /** Reads a checkpoint saved by save(). Returns false, reported on stderr, if it cannot be used. */
+    bool load(const std::string &path) {
+        std::ifstream inp(path);
+        if (!inp) {
+            std::cerr << "Could not read the checkpoint " << path << std::endl;
+            return false;
+        }
+        uint32_t found = 0;
+        std::string key, value;
+        while (inp >> key >> value) {
+            if (key == "line") {
+                line = strtou128(value.c_str());
+            } else if (key == "skip") {
+                skip = std::strtoul(value.c_str(), nullptr, 10);
+            } else if (key == "to") {
+                to = strtou128(value.c_str());
+            } else if (key == "remaining") {
+                remaining = std::strtoull(value.c_str(), nullptr, 10);
+            } else if (key == "bytes") {
+                bytes = std::strtoull(value.c_str(), nullptr, 10);
+            } else if (key == "layout") {
+                layout = std::strtoull(value.c_str(), nullptr, 16);
+            } else {
+                continue;
+            }
+            found++;
+        }
+        if ((found != 6) || (line == 0)) {
+            std::cerr << "The checkpoint " << path << " is incomplete" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    /** Saves the position reached by this run so far. The progress only ever moves forward, so
+     * this can run while the writers keep going. Returns false, reported on stderr, on errors. */
+    bool save(const std::string &path, const Rules &rules) const {
+        uint64_t delivered = progress.delivered.load(std::memory_order_acquire);
+        uint64_t pos = skip + delivered;
+        uint128_t next = rules.offsetLine(line, pos);
+        uint32_t cut = pos - uint64_t(rules.lineOffset(next) - rules.lineOffset(line));
+        bool bounded = remaining != std::numeric_limits<uint64_t>::max();
+        std::string tmp = path + ".tmp";
+        FILE *out = ::fopen(tmp.c_str(), "w");
+        if (out == nullptr) {
+            int err = errno;
+            std::cerr << "Could not write the checkpoint " << tmp << ": " << strerror(err) << std::endl;
+            return false;
+        }
+        ::fprintf(out, "line %s\nskip %u\nto %s\nremaining %lu\nbytes %lu\nlayout %016lx\n", tostring(next).c_str(),
+                  cut, tostring(to).c_str(), bounded ? remaining - delivered : remaining, bytes + delivered, layout);
+        bool ok = (::fflush(out) == 0) && (::fsync(::fileno(out)) == 0);
+        ok = (::fclose(out) == 0) && ok;
+        if (!ok || (::rename(tmp.c_str(), path.c_str()) < 0)) {
+            int err = errno;
+            std::cerr << "Could not save the checkpoint " << path << ": " << strerror(err) << std::endl;
+            return false;
+        }
+        return true;
+    }
+};
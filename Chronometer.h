@@ -7,6 +7,8 @@
 #include <string>
 #include <sstream>
 #include <iostream>
+#include <atomic>
+#include "Reporter.h"
 
 /** Returns the CPU timestamp counter - for performance measurement only */
 static uint64_t ticks() {
@@ -19,21 +21,49 @@ static uint64_t now() {
     return uint64_t(tp.tv_nsec) / 1000000 + uint64_t(tp.tv_sec) * 1000;
 }
 
-/** Computes throughput given number of bytes updates */
-class Chronometer {
+static uint64_t monotonicns() {
+    timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return uint64_t(tp.tv_nsec) + uint64_t(tp.tv_sec) * 1000000000;
+}
+
+/** TSC ticks per second. Measured against the monotonic clock over 10ms the first time it is
+ * called, since the nominal frequency differs on every host. */
+static uint64_t tickspersec() {
+    static const uint64_t frequency = []() {
+        uint64_t ns0 = monotonicns();
+        uint64_t t0 = ticks();
+        uint64_t ns1;
+        do {
+            ns1 = monotonicns();
+        } while (ns1 - ns0 < 10000000);
+        uint64_t t1 = ticks();
+        return uint64_t((t1 - t0) * 1E9 / (ns1 - ns0));
+    }();
+    return frequency;
+}
+
+/** Computes throughput given number of bytes updates.
+ * lap() only adds to a counter in its own cache line, the Reporter thread reads it and prints. */
+class Chronometer : public Reportable {
 private:
     uint64_t msecs_start = now();
     uint64_t msecs_lap = msecs_start;
     uint64_t tstart = ticks();
     uint64_t tlap = tstart;
     uint64_t timeout = 1000000000;
-    uint64_t bytes = 0;
-    uint64_t bytes_lap = 0;
+    uint64_t bytes_last = 0;                     //! Value of bytes at the last print, reporter side
+    alignas(64) std::atomic<uint64_t> bytes{0};  //! Written by the measured thread only
 
 public:
     /** Constructor is passed the timeout in ticks to print progress */
     Chronometer(uint64_t tmout) : timeout(tmout) {
         reset();
+        if (timeout > 0) Reporter::instance().add(this);
+    }
+
+    ~Chronometer() {
+        if (timeout > 0) Reporter::instance().remove(this);
     }
 
     /** Initializes internal state */
@@ -42,21 +72,28 @@ public:
         msecs_lap = msecs_start;
         tstart = ticks();
         tlap = tstart;
-        bytes = 0;
-        bytes_lap = 0;
+        bytes.store(0, std::memory_order_relaxed);
+        bytes_last = 0;
     }
 
     /** inputs updates on progress */
     void lap(uint64_t nb) {
-        bytes += nb;
-        bytes_lap += nb;
+        bytes.store(bytes.load(std::memory_order_relaxed) + nb, std::memory_order_relaxed);
+    }
+
+    /** Called from the reporter thread, prints when timeout is over */
+    void report() override {
         uint64_t tnow = ticks();
         if (tnow > tlap + timeout) {
+            uint64_t total = bytes.load(std::memory_order_relaxed);
             uint64_t msecs_now = now();
             uint64_t delta_start = msecs_now - msecs_start;
             uint64_t delta_lap = msecs_now - msecs_lap;
-            fprintf(stderr, "Lap: %ld bytes throughput: %ld %ld\n", bytes, bytes_lap / delta_lap, bytes / delta_start);
-            bytes_lap = 0;
+            if (delta_lap == 0) delta_lap = 1;
+            if (delta_start == 0) delta_start = 1;
+            fprintf(stderr, "Lap: %ld bytes throughput: %ld %ld\n", total, (total - bytes_last) / delta_lap,
+                    total / delta_start);
+            bytes_last = total;
             tlap = tnow;
             msecs_lap = msecs_now;
         }
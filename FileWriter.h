@@ -0,0 +1,216 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "Checkpoint.h"
+#include "Rules.h"
+
+/** Alignment of file offsets, sizes and memory for O_DIRECT writes */
+const uint32_t DIRECTALIGN = 4096;
+
+/** Used when the output is a regular file. Every chunk has a known byte offset so the generators
+ * pwrite() their own chunks in parallel, straight to their final place, without the writer thread.
+ * Alternatively the file is sized up front and mapped, and the generators render into it in place. */
+class FileWriter {
+private:
+    int fd;                           //! The output file
+    int directfd = -1;                //! The same file reopened with O_DIRECT, if requested
+    uint64_t start = 0;               //! File position where the output starts
+    uint128_t from;                   //! First number printed, at offset start
+    uint32_t skip;                    //! Bytes of the line `from` left out, already printed by an earlier run
+    const Rules &rules;               //! Gives the offset of every line
+    uint64_t maxbytes;                //! Nothing is written past start plus this
+    std::atomic<bool> failed{false};  //! Raised by the first write error, stops all the generators
+    char *mapping = nullptr;          //! Page aligned start of the mapped file, if mapped
+    uint64_t mapstart = 0;            //! File offset of mapping
+    uint64_t mapsize = 0;             //! Bytes mapped from mapping
+    uint64_t mapped = 0;              //! Bytes of output that fit in the mapping
+    Progress *progress = nullptr;     //! Bytes delivered so far for checkpoints, and the request to stop
+
+    std::mutex mutex;                      //! Guards the two below
+    std::map<uint64_t, uint64_t> pending;  //! Ranges of output written past the first hole, start to end
+    uint64_t contiguous = 0;               //! Bytes of output written with no hole before them
+
+    /** Writes the whole range, retrying on partial writes */
+    bool pwriteall(int outfd, const char *data, uint64_t size, uint64_t off) {
+        while (size > 0) {
+            ssize_t res = ::pwrite(outfd, data, size, off);
+            if (res > 0) {
+                data += res;
+                size -= res;
+                off += res;
+            } else if ((res < 0) && (errno != EINTR) && (errno != EAGAIN)) {
+                int err = errno;
+                if (!failed.exchange(true)) {
+                    std::cerr << "Error in pwrite() nbytes:" << size << " error:" << strerror(err) << std::endl;
+                }
+                return false;
+            }
+        }
+        return true;
+    }
+
+public:
+    /** Writes the numbers from first on, without the first cut bytes of that line, up to nbytes bytes */
+    FileWriter(int outfd, uint128_t first, uint32_t cut, uint64_t nbytes, const Rules &r)
+        : fd(outfd), from(first), skip(cut), rules(r), maxbytes(nbytes) {
+    }
+
+    ~FileWriter() {
+        if (mapping != nullptr) ::munmap(mapping, mapsize);
+        if (directfd >= 0) ::close(directfd);
+    }
+
+    /** Returns false if the output is not a regular file we can write at any offset.
+     * With direct, the aligned middle of every chunk bypasses the page cache. */
+    bool open(bool direct) {
+        struct stat st;
+        if ((::fstat(fd, &st) < 0) || !S_ISREG(st.st_mode)) return false;
+        int flags = ::fcntl(fd, F_GETFL);
+        if ((flags < 0) || ((flags & O_APPEND) != 0) || ((flags & O_ACCMODE) == O_RDONLY)) return false;
+        off_t pos = ::lseek(fd, 0, SEEK_CUR);
+        if (pos < 0) return false;
+        start = pos;
+        if (direct) {
+            char path[64];
+            ::snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+            directfd = ::open(path, O_WRONLY | O_DIRECT);
+            if (directfd < 0) {
+                int err = errno;
+                std::cerr << "O_DIRECT not available (" << strerror(err) << "), using the page cache" << std::endl;
+            }
+        }
+        return true;
+    }
+
+    /** Returns true after a write error or once asked to stop */
+    bool stopped() const {
+        return failed.load(std::memory_order_relaxed) ||
+               ((progress != nullptr) && progress->stop.load(std::memory_order_relaxed));
+    }
+
+    /** Returns false after a write error */
+    bool ok() const {
+        return !failed.load(std::memory_order_relaxed);
+    }
+
+    /** Publishes the written prefix of the output into p, and stops the generators once p asks to */
+    void track(Progress *p) {
+        progress = p;
+    }
+
+    /** Chunks complete in any order, only the bytes with no hole before them count as delivered */
+    void completed(uint64_t lo, uint64_t hi) {
+        if ((progress == nullptr) || (lo == hi)) return;
+        std::lock_guard<std::mutex> lock(mutex);
+        pending[lo] = hi;
+        for (auto it = pending.begin(); (it != pending.end()) && (it->first == contiguous); it = pending.erase(it)) {
+            contiguous = it->second;
+        }
+        progress->delivered.store(contiguous, std::memory_order_release);
+    }
+
+    /** File offset of the line that prints the number `line`. Only the distance to `from` has to
+     * fit in 64 bits, which any file does, however large the numbers are. */
+    uint64_t offset(uint128_t line) const {
+        if (line == from) return start;
+        return start + uint64_t(rules.lineOffset(line) - rules.lineOffset(from)) - skip;
+    }
+
+    /** Where a chunk starting at `line` has to be placed in its buffer so memory and file
+     * alignments match, as O_DIRECT needs */
+    uint32_t padding(uint128_t line) const {
+        return directfd >= 0 ? offset(line) % DIRECTALIGN : 0;
+    }
+
+    /** Writes a chunk at its offset, cutting it at the byte limit. With O_DIRECT, data has to be
+     * at padding() from an aligned address. Only the partial blocks at both ends go through
+     * the page cache, they never share a block with the direct part of any chunk. */
+    bool write(const char *data, uint64_t size, uint64_t off) {
+        if (off - start >= maxbytes) return true;
+        if (size > maxbytes - (off - start)) size = maxbytes - (off - start);
+        uint64_t lo = ((off + DIRECTALIGN - 1) / DIRECTALIGN) * DIRECTALIGN;
+        uint64_t hi = ((off + size) / DIRECTALIGN) * DIRECTALIGN;
+        bool ok;
+        if ((directfd < 0) || (lo >= hi)) {
+            ok = pwriteall(fd, data, size, off);
+        } else {
+            ok = pwriteall(fd, data, lo - off, off) && pwriteall(directfd, data + (lo - off), hi - lo, lo) &&
+                 pwriteall(fd, data + (hi - off), off + size - hi, hi);
+        }
+        if (ok) completed(off - start, off - start + size);
+        return ok;
+    }
+
+    /** Grows the file to hold exactly size bytes of output and maps it.
+     * Returns false if the file could not be sized or mapped. */
+    bool map(uint64_t size) {
+        mapstart = start - start % ::getpagesize();
+        if (::ftruncate(fd, start + size) < 0) {
+            int err = errno;
+            std::cerr << "Error in ftruncate(): " << strerror(err) << std::endl;
+            return false;
+        }
+        mapsize = start - mapstart + size;
+        if (mapsize == 0) return true;
+        // Shells open stdout write only but a shared writable mapping needs read access too
+        char path[64];
+        ::snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+        int mapfd = ::open(path, O_RDWR);
+        if (mapfd < 0) {
+            int err = errno;
+            std::cerr << "Error reopening the output for reading: " << strerror(err) << std::endl;
+            return false;
+        }
+        void *ptr = ::mmap(nullptr, mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, mapfd, mapstart);
+        int err = errno;
+        ::close(mapfd);
+        if (ptr == MAP_FAILED) {
+            std::cerr << "Error in mmap(): " << strerror(err) << std::endl;
+            return false;
+        }
+        mapping = (char *)ptr;
+        mapped = size;
+        return true;
+    }
+
+    /** Returns true if the output was mapped by map() */
+    bool ismapped() const {
+        return mapping != nullptr;
+    }
+
+    /** Where the line that prints the number `line` goes in the mapping */
+    char *address(uint128_t line) const {
+        return mapping + (offset(line) - mapstart);
+    }
+
+    /** Bytes left in the mapping from the line `line` to the end of the output */
+    uint64_t room(uint128_t line) const {
+        uint64_t used = offset(line) - start;
+        return used < mapped ? mapped - used : 0;
+    }
+
+    /** Once a chunk is rendered its pages are not needed anymore: starts their writeback and drops
+     * them from our address space so resident memory stays at a few chunks per thread.
+     * Pages shared with the neighbor chunks are fine to drop, as a file mapping they are still
+     * in the page cache and simply fault back in. */
+    void release(const char *ptr, uint64_t size) {
+        if (size == 0) return;
+        uint64_t page = ::getpagesize();
+        uint64_t lo = ((ptr - mapping) / page) * page;
+        uint64_t hi = ((ptr - mapping + size + page - 1) / page) * page;
+        if (hi > mapsize) hi = mapsize;
+        ::sync_file_range(fd, mapstart + lo, hi - lo, SYNC_FILE_RANGE_WRITE);
+        ::madvise(mapping + lo, hi - lo, MADV_DONTNEED);
+        uint64_t pos = (ptr - mapping) - (start - mapstart);
+        completed(pos, pos + size);
+    }
+};
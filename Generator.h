@@ -2,186 +2,230 @@
 
 #include <cstdint>
 #include <array>
+#include <vector>
 #include <thread>
-#include "BCD.h"
+#include <cstring>
 #include "Buffer.h"
 #include "PipeWriter.h"
+#include "Scheduler.h"
+#include "FileWriter.h"
 #include "NumericUtils.h"
+#include "Template.h"
+#include "Telemetry.h"
+#include "Topology.h"
+
+/** Returns the byte offset right after the first nlines lines of a text block of size bytes */
+static uint32_t skiplines(const char *ptr, uint32_t size, uint32_t nlines, char eol = '\n') {
+    const char *p = ptr;
+    for (; (nlines > 0) && (p < ptr + size); --nlines) {
+        p = (const char *)std::memchr(p, eol, ptr + size - p) + 1;
+    }
+    return p - ptr;
+}
 
 /** A fizzbuzz number generator with an embedded thread that feeds a PipeWriter */
 struct Generator {
-    uint64_t base;                  //! First number of the current 15-number block
-    uint64_t blockjump;             //! How much to jump at the end of a block
-    uint32_t counter;               //! Counts blocks (groups of 15 numbers)
-    uint32_t numblocks;             //! Total number of blocks to generate before writing into pipe
-    uint32_t numdigits;             //! Current number of digits on the numbers
-    uint32_t numchars;              //! Number of characters in the current precomputed buffer
-    std::array<BCD, 8> bcd;         //! Each fizzbuzz sequence of 15 lines has 8 actual numbers
-    std::array<char, 1024> buffer;  //! Contains the ascii text for each precomputed buffer
-    uint32_t offset;                //! Offset writing into the buffer
-    BufferPtr stash;                //! Accumulates text as blocks are being generated. Passed to PipeWriter.
-    PipeWriter &writer;             //! The object that actually writes to stdout on the main thread
-    std::thread th;                 //! Thread encapsulated by this object
-    LapTimer subtimer{"Submit", {"gen", "wait", "release"}, 5 * 3000000000};
-
-    Generator(PipeWriter &w, uint64_t start, uint32_t nblocks, uint64_t incr)
-        : base(start),
-          blockjump(incr),
+    uint128_t base;                //! First number of the current block
+    uint64_t seq;                  //! Sequence number of the current chunk
+    uint128_t firstline;           //! First number printed by the current chunk
+    uint128_t from;                //! First number to print, earlier lines in its block are cut
+    uint32_t skip;                 //! Bytes of the line `from` left out, already printed by an earlier run
+    uint128_t to;                  //! Last number to print (inclusive)
+    uint128_t lastbase;            //! First number of the block that contains `to`
+    uint32_t counter;              //! Counts blocks (one rules period each)
+    uint32_t numblocks;            //! Total number of blocks to generate before writing into pipe
+    uint32_t chunkblocks;          //! Number of blocks in the current chunk, less than numblocks at the end
+    uint32_t numchars;             //! Number of characters in the last block written
+    const Rules &rules;            //! What to print for every number
+    uint32_t period;               //! Numbers in a block
+    char eol;                      //! Last byte of every line
+    bool custom;                   //! Rendering with rulebank, the rules are not the standard ones
+    TemplateBank bank;             //! Precomputed blocks for every number of digits
+    RuleBank rulebank;             //! Same for any other rules
+    uint32_t offset;               //! Offset writing into the buffer
+    Buffer *stash;                 //! Accumulates text as blocks are being generated. Passed to PipeWriter.
+    PipeWriter &writer;            //! The object that actually writes to stdout on the main thread
+    Scheduler &scheduler;          //! Hands out the chunks shared by all generators
+    FileWriter *file;              //! Set when the output is a regular file we write into directly
+    PipeWriter::Channel &channel;  //! Our ring of buffers going to the writer and back
+    std::vector<char> scratch;     //! Holds the blocks that cannot be rendered in place in a mapped file
+    LapTimer subtimer{"Submit", {"gen", "wait"}, 5 * tickspersec()};
+    TelemetrySlot *telemetry;      //! Live counters for fbstat, null if not published
+    int cpu;                       //! Cpu this thread is pinned to, -1 if not pinned
+    std::thread th;  //! Thread encapsulated by this object. Last so it starts fully constructed.
+
+    /** first and last are the numbers of the whole requested range, chunks come from the scheduler.
+     * The first cut bytes of the line first are left out, see Checkpoint.
+     * With a file writer, chunks are written at their offsets from this thread and never reach w.
+     * With a cpu the thread is pinned there and its buffers are allocated on that cpu's node. */
+    Generator(PipeWriter &w, Scheduler &sched, FileWriter *fw, uint32_t nblocks, uint128_t first, uint128_t last,
+              const Rules &r, int pincpu = -1, uint32_t cut = 0)
+        : base(0),
+          seq(0),
+          firstline(0),
+          from(first),
+          skip(cut),
+          to(last),
+          lastbase(r.blockBase(last)),
           counter(0),
           numblocks(nblocks),
-          numdigits(0),
+          chunkblocks(0),
           numchars(0),
+          rules(r),
+          period(r.period),
+          eol(r.format.terminator()),
+          custom(!r.standard()),
+          rulebank(r),
           offset(0),
-          stash(w.request()),
+          stash(nullptr),
           writer(w),
+          scheduler(sched),
+          file(fw),
+          channel(w.attach(Topology::instance().node(pincpu))),
+          scratch(r.blockSize(r.format.maxWidth())),
+          telemetry(nullptr),
+          cpu(pincpu),
           th(&Generator::run, this) {
     }
 
-    /** Runs indefinitely generating fizzbuzz blocks and pushing into the pipe writer */
+    ~Generator() {
+        if (th.joinable()) th.join();
+    }
+
+    /** Claims chunks and pushes them into the pipe writer until the range is exhausted.
+     * A free buffer is taken before claiming so the writer's reorder window cannot overflow. */
     void run() {
-        counter = 0;
-        recalc();
-        while (true) {
+        if (cpu >= 0) ::pincpu(cpu);
+        telemetry = Telemetry::instance().claim("generator");
+        subtimer.publish(telemetry);
+        while (acquire() && plan()) {
+            seek(base);
+            firstline = base < from ? from : base;
+            if ((file != nullptr) && file->ismapped()) {
+                render(file->address(firstline), file->room(firstline));
+                continue;
+            }
+            offset = file != nullptr ? file->padding(firstline) : 0;
+            uint32_t start = offset;
             writeblock();
+            if ((base <= from) || (base + period - 1 > to)) trim(start);
+            for (counter = 1; counter < chunkblocks; ++counter) {
+                base += period;
+                writeblock();
+            }
+            if ((chunkblocks > 1) && (base + period - 1 > to)) trim(offset - numchars);
+            progress(file != nullptr ? offset - start : 0);
+            flush();
         }
     }
 
-    /** Recompute the block from scratch */
-    void recalc() {
-        if (digits(base) == digits(base + 15 - 1))
-            precompute();
-        else
-            vanilla();
+    /** Publishes the last number of the chunk just rendered and the bytes we wrote out ourselves */
+    void progress(uint64_t nbytes) {
+        if (telemetry == nullptr) return;
+        uint128_t last = base + period - 1 < to ? base + period - 1 : to;
+        telemetry->number.store(last < UINT64_MAX ? uint64_t(last) : UINT64_MAX, std::memory_order_relaxed);
+        telemetry->bytes.store(telemetry->bytes.load(std::memory_order_relaxed) + nbytes, std::memory_order_relaxed);
     }
 
-    /** Computes one single block of 15 numbers of fizzbuzz */
-    void advance(uint32_t delta) {
-        base += delta;
-        if (numdigits == digits(base + 15 - 1)) {
-            // we have a precomputed sequence, just increment our BCDs
-            for (BCD &bnum : bcd) bnum.increment(delta);
-        } else if (digits(base) == digits(base + 15 - 1))
-            precompute();
-        else
-            vanilla();
+    /** Claims and sizes the next chunk. Returns false once the range is exhausted. */
+    bool plan() {
+        if (writer.stopped() || ((file != nullptr) && file->stopped())) return false;
+        if (!scheduler.claim(seq, base)) return false;
+        uint128_t remaining = (lastbase - base) / period + 1;
+        chunkblocks = remaining < numblocks ? remaining : numblocks;
+        return true;
     }
 
-    /** Saves the current block to our stash. When the number of blocks ends, writes into the pipe writer */
-    uint32_t writeblock() {
-        std::memcpy(&stash->data[offset], &buffer[0], numchars);
-        offset += numchars;
-        if (++counter < numblocks) {
-            advance(15);
+    /** Renders the current chunk in place, straight into the mapped output file, up to room bytes.
+     * Blocks that are cut at the range edges, or whose tail could spill into the next chunk
+     * (which might be another thread's), go through a scratch block first. */
+    void render(char *dest, uint64_t room) {
+        uint64_t pos = 0;
+        for (counter = 0; counter < chunkblocks; ++counter) {
+            if (counter > 0) base += period;
+            if ((counter + 1 < chunkblocks) && (base > from)) {
+                pos += incfill(&dest[pos]);
+                continue;
+            }
+            numchars = incfill(scratch.data());
+            uint32_t lo = head(scratch.data());
+            uint32_t hi = base + period - 1 > to ? skiplines(scratch.data(), numchars, to - base + 1, eol) : numchars;
+            uint64_t size = hi - lo < room - pos ? hi - lo : room - pos;
+            std::memcpy(&dest[pos], &scratch[lo], size);
+            pos += size;
+        }
+        file->release(dest, pos);
+        progress(pos);
+    }
+
+    /** Positions the bank in use at the block starting at number */
+    void seek(uint128_t number) {
+        if (custom) {
+            rulebank.seek(number);
         } else {
-            flush();
-            advance(blockjump + 15);
+            bank.seek(number);
         }
+    }
+
+    /** Renders the block starting at base by incrementing the previous one. The standard rules
+     * keep their compile time templates, any other rules go through the runtime ones. */
+    uint32_t incfill(char *ptr) {
+        if (custom) return rulebank.incfill(base - rulebank.base, ptr);
+        return bank.incfill(base - bank.base, ptr);
+    }
+
+    /** Saves the block starting at base to our stash, incrementing the previous one */
+    uint32_t writeblock() {
+        numchars = incfill(&stash->data[offset]);
+        offset += numchars;
         return numchars;
     }
 
-    /** Once all the blocks are generated, writes the resulting string into the pipe writer */
+    /** Bytes to cut at the start of the block just rendered: the lines before from and the skipped part of from */
+    uint32_t head(const char *block) const {
+        return base <= from ? skiplines(block, numchars, from - base, eol) + skip : 0;
+    }
+
+    /** Cuts the lines outside [from,to] of the block just saved at start. Only happens at the range edges. */
+    void trim(uint32_t start) {
+        const char *block = &stash->data[start];
+        uint32_t lo = head(block);
+        uint32_t hi = base + period - 1 > to ? skiplines(block, numchars, to - base + 1, eol) : numchars;
+        std::memmove(&stash->data[start], &stash->data[start + lo], hi - lo);
+        offset = start + hi - lo;
+    }
+
+    /** Once all the blocks are generated, hands the buffer to the pipe writer.
+     * Writing to a file we just put the chunk in place ourselves and keep the buffer. */
     void flush() {
+        if (file != nullptr) {
+            uint32_t start = file->padding(firstline);
+            file->write(&stash->data[start], offset - start, file->offset(firstline));
+            return;
+        }
         stash->used = offset;
-        submit();
+        stash->seq = seq;
+        stash->eof = (base == lastbase);
+        channel.ready.push(stash);
+        stash = nullptr;
         offset = 0;
         counter = 0;
     }
 
-    /** Submits a completed buffer to be printed out */
-    void submit() {
+    /** Takes the next free buffer of our ring. Only waits when all our buffers are still queued
+     * or referenced by the pipe. Gives up if the writer is gone. */
+    bool acquire() {
         subtimer.lap(0);
-        while (stash->flag.load(std::memory_order_acquire) != 0) _mm_pause();
-        stash->flag.store(1, std::memory_order_release);
-        subtimer.lap(1);
-        while (stash->flag.load(std::memory_order_acquire) != 0) _mm_pause();
-        subtimer.lap(2);
-    }
-
-    /** Slow routine used to generate a block when it crosses a boundary */
-    void vanilla() {
-        char *p = &buffer[0];
-        p += sprintf(p, "%ld\n", base);
-        p += sprintf(p, "%ld\n", base + 1);
-        p += sprintf(p, "Fizz\n");
-        p += sprintf(p, "%ld\n", base + 3);
-        p += sprintf(p, "Buzz\n");
-        p += sprintf(p, "Fizz\n");
-        p += sprintf(p, "%ld\n", base + 6);
-        p += sprintf(p, "%ld\n", base + 7);
-        p += sprintf(p, "Fizz\n");
-        p += sprintf(p, "Buzz\n");
-        p += sprintf(p, "%ld\n", base + 10);
-        p += sprintf(p, "Fizz\n");
-        p += sprintf(p, "%ld\n", base + 12);
-        p += sprintf(p, "%ld\n", base + 13);
-        p += sprintf(p, "FizzBuzz\n");
-        numchars = p - &buffer[0];
-        numdigits = 0;
-    }
-
-    /** Precomputes a block of 15 numbers for which all of them have the same number of digits.
-     * If the block crosses a boundary (10,100,1000,etc) it will use the vanilla function instead. */
-    void precompute() {
-        numdigits = digits(base);
-        buffer.fill('0');
-        char *p = &buffer[0];
-        // number 0
-        bcd[0].init(p, base, numdigits);
-        p += numdigits;
-        *p++ = '\n';
-        // number 1
-        bcd[1].init(p, base + 1, numdigits);
-        p += numdigits;
-        *p++ = '\n';
-        // number 2
-        std::memcpy(p, "Fizz\n", 5);
-        p += 5;
-        // number 3
-        bcd[2].init(p, base + 3, numdigits);
-        p += numdigits;
-        *p++ = '\n';
-        // number 4
-        std::memcpy(p, "Buzz\n", 5);
-        p += 5;
-        // number 5
-        std::memcpy(p, "Fizz\n", 5);
-        p += 5;
-        // number 6
-        bcd[3].init(p, base + 6, numdigits);
-        p += numdigits;
-        *p++ = '\n';
-        // number 7
-        bcd[4].init(p, base + 7, numdigits);
-        p += numdigits;
-        *p++ = '\n';
-        // number 8
-        std::memcpy(p, "Fizz\n", 5);
-        p += 5;
-        // number 9
-        std::memcpy(p, "Buzz\n", 5);
-        p += 5;
-        // number 10
-        bcd[5].init(p, base + 10, numdigits);
-        p += numdigits;
-        *p++ = '\n';
-        // number 11
-        std::memcpy(p, "Fizz\n", 5);
-        p += 5;
-        // number 12
-        bcd[6].init(p, base + 12, numdigits);
-        p += numdigits;
-        *p++ = '\n';
-        // number 13
-        bcd[7].init(p, base + 13, numdigits);
-        p += numdigits;
-        *p++ = '\n';
-        // number 14
-        std::memcpy(p, "FizzBuzz\n", 9);
-        p += 9;
-        *p = '\0';
-        numchars = p - &buffer[0];
-        if (numchars > buffer.size()) {
-            std::cerr << "Exceeded buffer size num:" << numchars << " max:" << buffer.size() << std::endl;
+        if ((stash != nullptr) || ((file != nullptr) && file->ismapped())) {
+            subtimer.lap(1);
+            return true;
+        }
+        Backoff backoff;
+        while (!channel.empty.pop(stash)) {
+            if (writer.stopped()) return false;
+            backoff.pause();
         }
+        subtimer.lap(1);
+        return true;
     }
 };
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+
+/**
+ * Log-linear histogram of 64-bit values, like HdrHistogram with 4 bits of precision.
+ * Every power of two is split in 16 equal buckets so any value is known within 1/16 (6.25%)
+ * of itself, and values below 16 are exact. Recording is a count-leading-zeros, a shift
+ * and an increment, no division and no search.
+ * One thread records, any other thread can read it at the same time. Counters are relaxed
+ * atomics that only the recording thread writes, which costs the same as plain increments.
+ */
+class Histogram {
+public:
+    static constexpr uint32_t SUBBITS = 4;                                   //! Precision bits per power of two
+    static constexpr uint32_t SUBBUCKETS = 1 << SUBBITS;                     //! Buckets per power of two
+    static constexpr uint32_t NUMBUCKETS = (64 - SUBBITS + 1) * SUBBUCKETS;  //! Enough for any uint64_t
+
+    /** Index of the bucket that holds value */
+    static uint32_t bucket(uint64_t value) {
+        if (value < SUBBUCKETS) return value;
+        uint32_t exponent = 63 - __builtin_clzll(value);
+        return (exponent - SUBBITS + 1) * SUBBUCKETS + ((value >> (exponent - SUBBITS)) & (SUBBUCKETS - 1));
+    }
+
+    /** Largest value that falls in the bucket */
+    static uint64_t upper(uint32_t index) {
+        if (index < SUBBUCKETS) return index;
+        uint32_t exponent = index / SUBBUCKETS + SUBBITS - 1;
+        uint64_t sub = index % SUBBUCKETS;
+        uint64_t width = 1ULL << (exponent - SUBBITS);
+        return ((SUBBUCKETS + sub) << (exponent - SUBBITS)) + (width - 1);
+    }
+
+    Histogram() {
+        reset();
+    }
+
+    /** Called by the recording thread only */
+    void add(uint64_t value) {
+        std::atomic<uint32_t> &counter(counts[bucket(value)]);
+        counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        sum.store(sum.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+        if (value > maxvalue.load(std::memory_order_relaxed)) maxvalue.store(value, std::memory_order_relaxed);
+    }
+
+    /** Makes this hold what live recorded since previous, then moves previous up to live.
+     * Meant for a reporting thread while live keeps recording. The max is taken out of live,
+     * one that lands right at the swap may be reported in the next interval instead. */
+    void since(Histogram &live, Histogram &previous) {
+        for (uint32_t j = 0; j < NUMBUCKETS; ++j) {
+            uint32_t now = live.counts[j].load(std::memory_order_relaxed);
+            counts[j].store(now - previous.counts[j].load(std::memory_order_relaxed), std::memory_order_relaxed);
+            previous.counts[j].store(now, std::memory_order_relaxed);
+        }
+        uint64_t now = live.sum.load(std::memory_order_relaxed);
+        sum.store(now - previous.sum.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        previous.sum.store(now, std::memory_order_relaxed);
+        maxvalue.store(live.maxvalue.exchange(0, std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+
+    /** Value below which a fraction p (0..1) of the points fall, rounded up to its bucket */
+    uint64_t percentile(double p) const {
+        uint64_t total = count();
+        if (total == 0) return 0;
+        uint64_t target = p * total;
+        if (target < p * total) target++;
+        if (target == 0) target = 1;
+        uint64_t seen = 0;
+        for (uint32_t j = 0; j < NUMBUCKETS; ++j) {
+            seen += counts[j].load(std::memory_order_relaxed);
+            if (seen >= target) return upper(j) < max() ? upper(j) : max();
+        }
+        return max();
+    }
+
+    /** Points recorded, added up from the buckets to keep add() short */
+    uint64_t count() const {
+        uint64_t total = 0;
+        for (uint32_t j = 0; j < NUMBUCKETS; ++j) total += counts[j].load(std::memory_order_relaxed);
+        return total;
+    }
+
+    uint64_t mean() const {
+        uint64_t total = count();
+        return total > 0 ? sum.load(std::memory_order_relaxed) / total : 0;
+    }
+
+    uint64_t max() const {
+        return maxvalue.load(std::memory_order_relaxed);
+    }
+
+    void reset() {
+        for (uint32_t j = 0; j < NUMBUCKETS; ++j) counts[j].store(0, std::memory_order_relaxed);
+        sum.store(0, std::memory_order_relaxed);
+        maxvalue.store(0, std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<uint32_t> counts[NUMBUCKETS];  //! Points per bucket
+    std::atomic<uint64_t> sum;                 //! Sum of all points, for the mean
+    std::atomic<uint64_t> maxvalue;            //! Largest point, exact
+};
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/** Bare bones io_uring with raw syscalls, just enough to keep a few writes in flight
+ * without depending on liburing. Single threaded: one thread submits and reaps. */
+class IoUring {
+public:
+    IoUring() {
+    }
+
+    ~IoUring() {
+        if (sqptr != MAP_FAILED) ::munmap(sqptr, sqsize);
+        if ((cqptr != MAP_FAILED) && (cqptr != sqptr)) ::munmap(cqptr, cqsize);
+        if (sqes != MAP_FAILED) ::munmap(sqes, entries * sizeof(io_uring_sqe));
+        if (fd >= 0) ::close(fd);
+    }
+
+    /** Creates the rings. Returns false (errno set) if the kernel does not support io_uring. */
+    bool init(uint32_t depth) {
+        io_uring_params p;
+        std::memset(&p, 0, sizeof(p));
+        fd = ::syscall(__NR_io_uring_setup, depth, &p);
+        if (fd < 0) return false;
+        entries = p.sq_entries;
+
+        sqsize = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+        cqsize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single && (cqsize > sqsize)) sqsize = cqsize;
+        sqptr = ::mmap(nullptr, sqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sqptr == MAP_FAILED) return false;
+        cqptr = single ? sqptr
+                       : ::mmap(nullptr, cqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                                IORING_OFF_CQ_RING);
+        if (cqptr == MAP_FAILED) return false;
+        sqes = ::mmap(nullptr, entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) return false;
+
+        char *sq = (char *)sqptr;
+        sqtail = (uint32_t *)(sq + p.sq_off.tail);
+        sqmask = *(uint32_t *)(sq + p.sq_off.ring_mask);
+        sqarray = (uint32_t *)(sq + p.sq_off.array);
+        char *cq = (char *)cqptr;
+        cqhead = (uint32_t *)(cq + p.cq_off.head);
+        cqtail = (uint32_t *)(cq + p.cq_off.tail);
+        cqmask = *(uint32_t *)(cq + p.cq_off.ring_mask);
+        cqes = (io_uring_cqe *)(cq + p.cq_off.cqes);
+        return true;
+    }
+
+    /** Maximum number of submissions in flight */
+    uint32_t depth() const {
+        return entries;
+    }
+
+    /** Queues a write of size bytes at offset (-1 for the current position) tagged with user.
+     * Linked writes only start once the previous one completed. */
+    void write(int outfd, const char *data, uint32_t size, int64_t offset, uint64_t user, bool link) {
+        uint32_t tail = *sqtail;
+        uint32_t idx = tail & sqmask;
+        io_uring_sqe *sqe = (io_uring_sqe *)sqes + idx;
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = outfd;
+        sqe->addr = (uint64_t)data;
+        sqe->len = size;
+        sqe->off = (uint64_t)offset;
+        sqe->user_data = user;
+        sqe->flags = link ? IOSQE_IO_LINK : 0;
+        sqarray[idx] = idx;
+        __atomic_store_n(sqtail, tail + 1, __ATOMIC_RELEASE);
+        pending++;
+    }
+
+    /** Submits the queued writes and waits for at least mincomplete completions */
+    int enter(uint32_t mincomplete) {
+        uint32_t flags = mincomplete > 0 ? IORING_ENTER_GETEVENTS : 0;
+        int res = ::syscall(__NR_io_uring_enter, fd, pending, mincomplete, flags, nullptr, 0);
+        if (res > 0) pending -= res;
+        return res;
+    }
+
+    /** Pops one completion if there is any */
+    bool reap(uint64_t &user, int32_t &res) {
+        uint32_t head = *cqhead;
+        if (head == __atomic_load_n(cqtail, __ATOMIC_ACQUIRE)) return false;
+        const io_uring_cqe &cqe(cqes[head & cqmask]);
+        user = cqe.user_data;
+        res = cqe.res;
+        __atomic_store_n(cqhead, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+private:
+    int fd = -1;
+    uint32_t entries = 0;
+    uint32_t pending = 0;  //! Queued but not submitted yet
+    void *sqptr = MAP_FAILED;
+    void *cqptr = MAP_FAILED;
+    void *sqes = MAP_FAILED;
+    size_t sqsize = 0;
+    size_t cqsize = 0;
+    uint32_t *sqtail = nullptr;
+    uint32_t sqmask = 0;
+    uint32_t *sqarray = nullptr;
+    uint32_t *cqhead = nullptr;
+    uint32_t *cqtail = nullptr;
+    uint32_t cqmask = 0;
+    io_uring_cqe *cqes = nullptr;
+};
@@ -1,54 +1,86 @@
-
 #pragma once
 
 #include "Chronometer.h"
+#include "Histogram.h"
+#include "Reporter.h"
+#include "Telemetry.h"
 #include <vector>
 #include <limits>
 
 /**
- * Used to compute a simple average for steps through a sequence of events.
+ * Used to compute latency distributions for steps through a sequence of events.
+ * Every step keeps a log-linear histogram of TSC deltas and reports its mean, p50, p90, p99,
+ * p99.9 and max, since a stall now and then is what hurts the reader, not the average.
  * This is simpler and less intrusive r using a full blown valgrind or vtune.
  * As such, it can be left in release binaries for monitoring.
  * We are not really worried about TSC rollover (which happens) since this is only informative.
+ * The timed thread only bumps counters in its own cache lines. Snapshots are taken, formatted
+ * and printed by the Reporter thread so the timed loop never stalls on stderr.
+ * With publish() the ticks of every step are also added up in a Telemetry slot for fbstat.
  */
-class LapTimer {
-    /** Will hold our stats for each step */
-    struct Bin {
-        double sum = 0;      //! Sum of all event points
-        uint32_t count = 0;  //! Counts number of points
+class LapTimer : public Reportable {
+    /** Will hold our stats for each step, one cache line apart so only its thread touches it */
+    struct alignas(64) Bin {
+        Histogram deltas;    //! Distribution of the TSC deltas into this step, since the start
         uint64_t start = 0;  //! Holds the TSC reading at the last start point
         std::string name;    //! Name of this step
     };
-    std::vector<Bin> bins;  //! Holds all the steps
-    uint64_t interval;      //! Print interval
-    uint64_t nextprint;     //! Indicates when (TSC) we will print next
-    std::string name;       //! Name of this sequence
-    uint32_t last;          //! Last step input
+    std::vector<Bin> bins;            //! Holds all the steps, written by the timed thread
+    std::vector<Histogram> previous;  //! Snapshot of every step at the last print, reporter side
+    Histogram window;                 //! Scratch for the interval being printed, reporter side
+    uint64_t interval;                //! Print interval
+    uint64_t nextprint;               //! Indicates when (TSC) we will print next
+    std::string name;                 //! Name of this sequence
+    uint32_t last;                    //! Last step input
+    TelemetrySlot *slot = nullptr;    //! Also adds the step ticks here, if published
 
 public:
     //! Initializes this object with a name, step definitions and a print timeout
-    LapTimer(const std::string &message, const std::vector<std::string> &names, uint64_t timeout) {
+    LapTimer(const std::string &message, const std::vector<std::string> &names, uint64_t timeout)
+        : bins(names.size()), previous(names.size()) {
         name = message;
         interval = timeout;
         nextprint = interval > 0 ? ticks() + interval : std::numeric_limits<uint64_t>::max();
-        bins.resize(names.size());
         for (uint32_t j = 0; j < names.size(); ++j) {
             bins[j].name = names[j];
         }
         last = 0;
+        if (interval > 0) Reporter::instance().add(this);
+    }
+
+    ~LapTimer() {
+        if (interval > 0) Reporter::instance().remove(this);
     }
 
-    //! Will print when timeout is over
+    //! Adds the ticks of the first TelemetrySlot::NUMSTEPS steps to slot from now on
+    void publish(TelemetrySlot *telemetry) {
+        if (telemetry == nullptr) return;
+        for (uint32_t j = 0; (j < bins.size()) && (j < TelemetrySlot::NUMSTEPS); ++j) {
+            ::strncpy(telemetry->steps[j], bins[j].name.c_str(), sizeof(telemetry->steps[j]) - 1);
+        }
+        slot = telemetry;
+    }
+
+    //! Called from the reporter thread, prints when timeout is over unless nothing was timed
+    void report() override {
+        uint64_t now = ticks();
+        if (now > nextprint) {
+            nextprint = now + interval;
+            if (!bins.empty() && (bins[0].deltas.count() != previous[0].count())) print();
+        }
+    }
+
+    //! Prints what was recorded since the last print
     //! This method is public for if timeout is zero, it will not print so it can be called manually
     void print() {
         std::ostringstream oss;
         oss << "[" << name << "] ";
         for (uint32_t j = 0; j < bins.size(); ++j) {
-            Bin &b(bins[j]);
-            uint64_t avg = b.sum / b.count;
-            oss << b.name << ":" << avg << " ";
-            b.sum = 0;
-            b.count = 0;
+            window.since(bins[j].deltas, previous[j]);
+            oss << bins[j].name << "(n:" << window.count() << " avg:" << window.mean()
+                << " p50:" << window.percentile(0.5) << " p90:" << window.percentile(0.9)
+                << " p99:" << window.percentile(0.99) << " p99.9:" << window.percentile(0.999)
+                << " max:" << window.max() << ") ";
         }
         std::cerr << oss.str() << "\n";
     }
@@ -65,26 +97,21 @@ public:
             // Compute the difference between the previous and the current timestamp
             // Note that last==0 at start so the first point will not be computed (as expected)
             uint64_t delta = now - bins[prev].start;
-            Bin &b(bins[step]);
-            b.sum += delta;
-            b.count++;
+            bins[step].deltas.add(delta);
+            if ((slot != nullptr) && (step < TelemetrySlot::NUMSTEPS)) {
+                std::atomic<uint64_t> &counter(slot->ticks[step]);
+                counter.store(counter.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+                if (step == 0) {
+                    slot->laps.store(slot->laps.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                }
+            }
         } else {
             if (last != 0) {
                 // If you call with the wrong sequence you'll know very fast
                 std::cerr << "LapTimer[" << name << "]: expected " << last << " got " << prev << "\n";
             }
         }
-        // For every start of sequence, check if we need to print
-        if (step == 0) {
-            if (now > nextprint) {
-                // Compute the next time and print
-                nextprint = now + interval;
-                print();
-            }
-            // Reset the counter to eliminate the print time, which can be very big
-            bins[step].start = ticks();
-        }
         // Remember the last step - for sanity purposes
         last = step;
     }
-};
\ No newline at end of file
+};
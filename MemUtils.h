@@ -2,6 +2,9 @@
 
 #include <cstdint>
 #include <cstdio>
+#include <cstdlib>
+#include <cctype>
+#include <string>
 #include <unistd.h>
 #include <cstring>
 #include <chrono>
@@ -9,7 +12,10 @@
 #include <fstream>
 #include <iostream>
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <linux/mman.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <errno.h>
 
 /** Computes the next round size that fits on full pages */
@@ -33,6 +39,77 @@ static void *vmalloc(size_t size) {
     return ret;
 }
 
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+/** Allocates size bytes of explicit huge pages: 1GB pages if it takes at least one, else 2MB pages.
+ * Falls back to regular pages with transparent huge pages requested. The size is rounded up to
+ * the page size tried, mapsize returns what has to be passed to vmfree(). Nothing is touched yet. */
+static void *hugealloc(size_t size, size_t &mapsize) {
+    const size_t sizes[2] = {1UL << 30, 2UL << 20};
+    const int flags[2] = {MAP_HUGE_1GB, MAP_HUGE_2MB};
+    for (uint32_t j = 0; j < 2; ++j) {
+        if ((j == 0) && (size < sizes[0])) continue;
+        mapsize = ((size + sizes[j] - 1) / sizes[j]) * sizes[j];
+        int mapflags = MAP_ANONYMOUS | MAP_PRIVATE | MAP_HUGETLB | flags[j];
+        void *ptr = ::mmap(nullptr, mapsize, PROT_READ | PROT_WRITE, mapflags, -1, 0);
+        if (ptr != MAP_FAILED) return ptr;
+    }
+    // Aligned to 2MB so THP can back the whole range
+    size_t huge = 2UL << 20;
+    mapsize = ((size + huge - 1) / huge) * huge;
+    char *ptr = (char *)::mmap(nullptr, mapsize + huge, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (ptr == MAP_FAILED) return nullptr;
+    char *aligned = (char *)((((uintptr_t)ptr) + huge - 1) & ~(huge - 1));
+    if (aligned > ptr) ::munmap(ptr, aligned - ptr);
+    ::munmap(aligned + mapsize, ptr + huge - aligned);
+    ::madvise(aligned, mapsize, MADV_HUGEPAGE);
+    return aligned;
+}
+
+/** Faults in a page aligned range for writing so the first pass over it does not take page faults.
+ * Uses MADV_POPULATE_WRITE (Linux 5.14) and falls back to writing one byte per page. */
+static void prefault(void *ptr, size_t size) {
+    if (size == 0) return;
+    if (::madvise(ptr, size, MADV_POPULATE_WRITE) == 0) return;
+    size_t page_size = ::getpagesize();
+    for (size_t off = 0; off < size; off += page_size) ((volatile char *)ptr)[off] = 0;
+}
+
+/** Size of the pages backing the mapping that contains ptr, as found in /proc/self/smaps.
+ * Transparent huge pages count as huge if they back at least half the mapping. */
+static size_t backingpagesize(const void *ptr) {
+    std::ifstream inp("/proc/self/smaps");
+    std::string line;
+    bool inside = false;
+    size_t total = 0;
+    size_t kernelpage = ::getpagesize();
+    while (std::getline(inp, line)) {
+        unsigned long lo, hi;
+        char dash;
+        if ((line.size() > 0) && ::isxdigit(line[0]) && (::sscanf(line.c_str(), "%lx%c%lx", &lo, &dash, &hi) == 3) &&
+            (dash == '-')) {
+            if (inside) break;
+            inside = ((uintptr_t)ptr >= lo) && ((uintptr_t)ptr < hi);
+            total = hi - lo;
+        } else if (inside && (line.compare(0, 15, "KernelPageSize:") == 0)) {
+            kernelpage = std::strtoul(line.c_str() + 15, nullptr, 10) * 1024;
+        } else if (inside && (line.compare(0, 14, "AnonHugePages:") == 0)) {
+            size_t thp = std::strtoul(line.c_str() + 14, nullptr, 10) * 1024;
+            if (thp * 2 >= total) return 2UL << 20;
+        }
+    }
+    return kernelpage;
+}
+
+/** Minor page faults taken by the whole process so far */
+static uint64_t minorfaults() {
+    rusage usage;
+    if (::getrusage(RUSAGE_SELF, &usage) < 0) return 0;
+    return usage.ru_minflt;
+}
+
 /** Returns the maximum pipe buffer size */
 static uint32_t getmaxpipe() {
     std::ifstream inp("/proc/sys/fs/pipe-max-size");
@@ -41,6 +118,12 @@ static uint32_t getmaxpipe() {
     return sz;
 }
 
+/** Returns true if the reader of the pipe went away. Nothing will drain what is left in it. */
+static bool pipeclosed(int fd) {
+    pollfd pfd{fd, POLLOUT, 0};
+    return (::poll(&pfd, 1, 0) > 0) && ((pfd.revents & POLLERR) != 0);
+}
+
 /** Returns the size of the L2 cache */
 static uint32_t getL2CacheSize() {
     std::ifstream inp("/sys/devices/system/cpu/cpu0/cache/index2/size");
@@ -2,6 +2,7 @@
 
 #include <cstdint>
 #include <array>
+#include <string>
 #include <tuple>
 
 /** VERY slow way to compute the next power of 10. Use vlog10 instead. */
@@ -139,6 +140,121 @@ static uint32_t digits(uint64_t num) {
     return numdigits;
 }
 
+/** Line numbers of the main generator. Past 2^64 the stream keeps going in 128 bits, up to 39 digits. */
+typedef unsigned __int128 uint128_t;
+
+/** Largest 128 bit number, 340282366920938463463374607431768211455 */
+static constexpr uint128_t UINT128MAX = ~uint128_t(0);
+
+/** Digits of UINT128MAX, the widest decimal number we print */
+const uint32_t MAXWIDEDIGITS = 39;
+
+/** Same as Pow2Item for 128 bit numbers */
+struct WidePow2Item {
+    uint32_t digits;      // Number of digits of the first power of 2 in this sequence
+    uint128_t nextpow10;  // Next power of 10 value, UINT128MAX for the 39 digit numbers as 10^39 does not fit
+};
+
+/** The levels table extended to 128 bits. There are no 128 bit literals so it is computed at compile time. */
+static constexpr std::array<WidePow2Item, 128> makeWideLevels() {
+    std::array<WidePow2Item, 128> table{};
+    uint32_t numdigits = 1;
+    uint128_t pow10 = 10;
+    for (uint32_t j = 0; j < 128; ++j) {
+        while ((uint128_t(1) << j) >= pow10) {
+            numdigits++;
+            pow10 = numdigits < MAXWIDEDIGITS ? pow10 * 10 : UINT128MAX;
+        }
+        table[j] = {numdigits, pow10};
+    }
+    return table;
+}
+static constexpr std::array<WidePow2Item, 128> widelevels = makeWideLevels();
+
+/** O(1) number of digits and next power of 10 of a 128 bit number, same as the 64 bit vlog10.
+ * The next power of 10 of the 39 digit numbers is saturated to UINT128MAX. */
+static std::tuple<uint32_t, uint128_t> vlog10(uint128_t num) {
+    if (num == 0) return {1, 1};
+    uint64_t high = num >> 64;
+    uint32_t numbits = high != 0 ? 128 - __builtin_clzl(high) : 64 - __builtin_clzl(uint64_t(num));
+    const WidePow2Item &p2(widelevels[numbits - 1]);
+    if ((num < p2.nextpow10) || (p2.digits == MAXWIDEDIGITS)) {
+        return {p2.digits, p2.nextpow10};
+    }
+    return {p2.digits + 1, p2.digits + 1 < MAXWIDEDIGITS ? p2.nextpow10 * 10 : UINT128MAX};
+}
+
+/** Returns the number of digits of a 128 bit number */
+static uint32_t digits(uint128_t num) {
+    return std::get<0>(vlog10(num));
+}
+
+/** O(1) number of digits of num in radix 8, 10 or 16. The power of two radices only need the
+ * position of the highest bit, decimal goes through the vlog10 table. */
+static uint32_t radixdigits(uint128_t num, uint32_t radix) {
+    if (radix == 10) return digits(num);
+    uint64_t high = num >> 64;
+    uint32_t numbits = high != 0 ? 128 - __builtin_clzl(high) : num == 0 ? 1 : 64 - __builtin_clzl(uint64_t(num));
+    uint32_t bits = __builtin_ctz(radix);
+    return (numbits + bits - 1) / bits;
+}
+
+/** Lowercase digits of the radices we print in */
+static const char radixchars[] = "0123456789abcdef";
+
+/** Writes the ndigits lowest digits of num in radix 8, 10 or 16, zero padded, ending right before end.
+ * Decimal goes 19 digits at a time so the digit loop runs on 64 bits, 128 bit divisions are slow. */
+static void writedigits(char *end, uint32_t ndigits, uint128_t num, uint32_t radix = 10) {
+    if (radix != 10) {
+        const uint32_t bits = __builtin_ctz(radix);
+        for (uint32_t j = 0; j < ndigits; ++j) {
+            *--end = radixchars[uint32_t(num) & (radix - 1)];
+            num >>= bits;
+        }
+        return;
+    }
+    const uint64_t pow19 = 10000000000000000000ULL;
+    uint64_t part = 0;
+    for (uint32_t j = 0; j < ndigits; ++j) {
+        if (j % 19 == 0) {
+            part = num % pow19;
+            num /= pow19;
+        }
+        *--end = '0' + part % 10;
+        part /= 10;
+    }
+}
+
+/** Prints num in the radix, zero padded to width, without a null. Returns the number of characters. */
+static uint32_t printnumber(char *ptr, uint128_t num, uint32_t width = 0, uint32_t radix = 10) {
+    uint32_t ndigits = radixdigits(num, radix);
+    if (ndigits < width) ndigits = width;
+    writedigits(ptr + ndigits, ndigits, num, radix);
+    return ndigits;
+}
+
+/** Decimal text of a 128 bit number, for messages */
+static std::string tostring(uint128_t num) {
+    char text[64];
+    return std::string(text, printnumber(text, num));
+}
+
+/** Parses the leading decimal digits of text into 128 bits, saturating at UINT128MAX like strtoull */
+static uint128_t strtou128(const char *text) {
+    uint128_t num = 0;
+    for (; (*text >= '0') && (*text <= '9'); ++text) {
+        uint32_t digit = *text - '0';
+        if (num > (UINT128MAX - digit) / 10) return UINT128MAX;
+        num = num * 10 + digit;
+    }
+    return num;
+}
+
+/** Size of a 15-number stringified fizzbuzz block where all the numbers have ndigits digits */
+static constexpr uint32_t blockSize(uint32_t ndigits) {
+    return 15 + 6 * 4 + 1 * 8 + ndigits * 8;
+}
+
 /** Computes the size of a 15-number stringified fizzbuzz block */
 static uint32_t calcBlockSize(uint64_t base) {
     // Computes the number of digits of the first number in the block
@@ -152,7 +268,7 @@ static uint32_t calcBlockSize(uint64_t base) {
     const uint32_t numalpha = 6 * 4 + 1 * 8;
     uint64_t diff = nextpow10 - base;
     if (diff >= 15) {
-        return numlf + numalpha + numdigits * 8;
+        return blockSize(numdigits);
     }
 
     // We have a mix, need to compute how many before and after the next power of 10
@@ -160,3 +276,79 @@ static uint32_t calcBlockSize(uint64_t base) {
     uint32_t nbefore = nfirst[diff];
     return numlf + numalpha + numdigits * nbefore + (numdigits + 1) * (8 - nbefore);
 }
+
+/** Counts how many numbers in [1,num] are printed as digits, ie are neither multiples of 3 nor 5 */
+static constexpr uint64_t countNumbers(uint64_t num) {
+    return num - num / 3 - num / 5 + num / 15;
+}
+
+/** Largest digit width for which the byte offsets of a whole epoch still fit in 64 bits */
+const uint32_t MAXOFFSETDIGITS = 18;
+
+/** Holds per digit width (epoch) the bytes used by the number lines of all the narrower epochs.
+ * Word lines are not included as they do not depend on the width. */
+static constexpr std::array<uint64_t, MAXOFFSETDIGITS + 2> makeEpochBytes() {
+    std::array<uint64_t, MAXOFFSETDIGITS + 2> table{};
+    uint64_t low = 1;
+    for (uint32_t d = 1; d <= MAXOFFSETDIGITS; ++d) {
+        table[d + 1] = table[d] + (d + 1) * (countNumbers(low * 10 - 1) - countNumbers(low - 1));
+        low *= 10;
+    }
+    return table;
+}
+static constexpr std::array<uint64_t, MAXOFFSETDIGITS + 2> epochbytes = makeEpochBytes();
+
+/** O(1) byte offset in the output of the line that prints the number `line` (1-based).
+ * Exact for numbers up to 10^18, beyond that the offsets do not fit in 64 bits. */
+static uint64_t lineOffset(uint64_t line) {
+    uint64_t m = line - 1;
+    if (m == 0) return 0;
+    uint64_t fizzbuzz = m / 15;
+    uint64_t words = 5 * (m / 3 + m / 5 - 2 * fizzbuzz) + 9 * fizzbuzz;
+    uint32_t numdigits;
+    uint64_t nextpow10;
+    std::tie(numdigits, nextpow10) = vlog10(m);
+    uint64_t low = nextpow10 / 10;
+    return words + epochbytes[numdigits] + (numdigits + 1) * (countNumbers(m) - countNumbers(low - 1));
+}
+
+/** Returns the size in bytes of the single line that prints the number `line` */
+static uint32_t lineSize(uint64_t line) {
+    if (line % 15 == 0) return 9;
+    if ((line % 3 == 0) || (line % 5 == 0)) return 5;
+    return digits(line) + 1;
+}
+
+/** Returns the line (ie the number) that contains the given byte offset.
+ * Finds the digit width epoch, jumps whole blocks inside it and finishes within one block. */
+static uint64_t offsetLine(uint64_t offset) {
+    uint32_t numdigits = 1;
+    uint64_t low = 1;
+    while ((numdigits < MAXOFFSETDIGITS) && (lineOffset(low * 10) <= offset)) {
+        low *= 10;
+        numdigits++;
+    }
+    // First 15-number block that starts inside this epoch
+    uint64_t line = ((low + 13) / 15) * 15 + 1;
+    uint64_t lineoff = lineOffset(line);
+    if (lineoff <= offset) {
+        const uint32_t blocksize = blockSize(numdigits);
+        uint64_t nblocks = (offset - lineoff) / blocksize;
+        line += 15 * nblocks;
+        lineoff += blocksize * nblocks;
+    } else {
+        line = low;
+        lineoff = lineOffset(line);
+    }
+    // At most one block worth of lines left to walk
+    for (uint32_t size = lineSize(line); lineoff + size <= offset; size = lineSize(line)) {
+        lineoff += size;
+        line++;
+    }
+    return line;
+}
+
+/** Total number of bytes used by the lines that print the numbers from..to (inclusive) */
+static uint64_t rangeBytes(uint64_t from, uint64_t to) {
+    return lineOffset(to + 1) - lineOffset(from);
+}
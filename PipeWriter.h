@@ -3,50 +3,129 @@
 #include <cstdint>
 #include <cassert>
 #include <vector>
+#include <deque>
+#include <algorithm>
+#include <limits>
+#include "Checkpoint.h"
 #include "LapTimer.h"
+#include "Telemetry.h"
+#include "Topology.h"
 #include "Buffer.h"
+#include "SPSCQueue.h"
+#include "SpinLock.h"
 #include "MemUtils.h"
 #include <immintrin.h>
 #include <sys/ioctl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#ifdef FIZZBUZZ_URING
+#include "IoUring.h"
+#endif
 
-/** Responsible for allocating buffers to the main thread and print them out when submitted */
+/** Responsible for allocating buffers to the generator threads and print them out when submitted */
 class PipeWriter {
+public:
+    /** The link between one generator and the writer. Filled buffers go through ready,
+     * buffers the pipe does not reference anymore come back through empty. */
+    struct Channel {
+        SPSCQueue<Buffer *> ready;
+        SPSCQueue<Buffer *> empty;
+        Channel(uint32_t nbuffers) : ready(nbuffers), empty(nbuffers) {
+        }
+    };
+
 private:
     uint32_t numthreads;
+    uint32_t numbuffers;  //! Buffers owned by each generator
     uint32_t index = 0;
     uint32_t blocksize = 0;
     std::vector<BufferPtr> avail;
-    LapTimer timer{"PQueue", {"write", "wait"}, 5 * 3000000000};
+    std::vector<std::unique_ptr<Channel>> channels;
+    std::deque<Buffer *> inflight;  //! Written buffers, possibly still referenced by the pipe
+    std::vector<Buffer *> window;   //! Chunks that arrived ahead of their turn, by sequence number
+    uint64_t nextseq = 0;           //! Sequence number of the next chunk to print
+    LapTimer timer{"PQueue", {"write", "wait"}, 5 * tickspersec()};
     uint64_t lastval = 0;
     uint64_t lastdiff = 0;
     char *global_buffer;
     size_t global_buffer_size;
+    size_t global_map_size;  //! Mapped size, rounded up to the huge page size
+    bool prefaulted;         //! Buffers are faulted in as generators attach
+    int fd = -1;
+    bool haspipe = false;
+    uint64_t maxbytes;                   //! Stops after writing this many bytes, like head -c
+    uint64_t total = 0;                  //! Bytes written so far
+    bool closed = false;                 //! The output cannot be written anymore
+    bool error = false;                  //! The output was closed by an actual error
+    bool uring;                          //! Keeps writes in flight with io_uring instead of blocking calls
+    std::atomic<bool> done{false};       //! Raised when the writer finishes so generators can bail out
+    TelemetrySlot *telemetry = nullptr;  //! Live counters for fbstat, if published
+    Progress *progress = nullptr;        //! Bytes delivered so far for checkpoints, and the request to stop
+    uint64_t maxlag = 0;                 //! Serving clients on a listening socket, the most they can lag behind
 
-    struct Data {
-        char *data;
-        uint32_t size;
-        std::atomic<uint32_t> &flag;
-    };
+    /** Returns the next chunk in sequence if it already arrived, null otherwise */
+    Buffer *trypop() {
+        Buffer *&slot = window[nextseq % window.size()];
+        if (slot == nullptr) {
+            for (auto &ch : channels) {
+                Buffer *b;
+                while (ch->ready.pop(b)) {
+                    window[b->seq % window.size()] = b;
+                }
+            }
+            if (slot == nullptr) return nullptr;
+        }
+        Buffer *b = slot;
+        slot = nullptr;
+        nextseq++;
+        return b;
+    }
 
-    Data popqueue() {
+    /** Waits for the next chunk in sequence, recycling old buffers meanwhile.
+     * Generators grab a free buffer before claiming a chunk so no chunk can be further ahead than
+     * the number of buffers, which is the size of the reorder window. Returns null once the output is closed. */
+    Buffer *popqueue() {
         timer.lap(0);
-
-        // Wait for the buffer to become ready (1)
-        Buffer *b = avail[index].get();
-        while (b->flag.load(std::memory_order_acquire) != 1) _mm_pause();
-
-        Data data{b->data, b->used, b->flag};
-
-        // Increment for next thread
-        if (++index >= avail.size()) {
-            index = 0;
+        Buffer *b;
+        Backoff backoff;
+        while ((b = trypop()) == nullptr) {
+            recycle();
+            if (closed) return nullptr;
+            backoff.pause();
         }
+        timer.lap(1);
+        return b;
+    }
 
-        // Releases the thread
-        b->flag.store(2, std::memory_order_release);
+    /** Hands written buffers back to their generators. vmsplice() only maps the pages into the pipe
+     * so a buffer can only be reused once the reader consumed it. If the reader went away instead,
+     * what is left in the pipe will never be read and the output is closed. */
+    void recycle() {
+        if (inflight.empty()) return;
+        int unread = 0;
+        if (haspipe && (::ioctl(fd, FIONREAD, &unread) < 0)) return;
+        if (telemetry != nullptr) telemetry->unread.store(unread, std::memory_order_relaxed);
+        if (inflight.front()->end + unread > total) {
+            pollfd pfd{fd, POLLOUT, 0};
+            if ((::poll(&pfd, 1, 0) > 0) && ((pfd.revents & POLLERR) != 0)) closed = true;
+            return;
+        }
+        while (!inflight.empty() && (inflight.front()->end + unread <= total)) {
+            Buffer *b = inflight.front();
+            inflight.pop_front();
+            channels[b->index]->empty.push(b);
+        }
+    }
 
-        timer.lap(1);
-        return data;
+    /** Stops the output on a write error. A closed pipe just means the consumer went away (eg head)
+     * so it is not reported as an error. */
+    void fail(const char *call, ssize_t res) {
+        int err = errno;
+        closed = true;
+        if (err != EPIPE) {
+            error = true;
+            std::cerr << "Error in " << call << " nbytes:" << res << " error:" << strerror(err) << std::endl;
+        }
     }
 
     void sanity(const char *data) {
@@ -76,10 +155,22 @@ private:
     }
 
 public:
-    PipeWriter(uint32_t nthreads, uint32_t bufsize) {
+    /** With hugepages the buffers come from explicit huge pages if there are any, transparent ones
+     * otherwise, and every generator's share is prefaulted as it attaches */
+    PipeWriter(uint32_t nthreads, uint32_t bufsize, uint32_t nbuffers = 2,
+               uint64_t nbytes = std::numeric_limits<uint64_t>::max(), bool useuring = false,
+               bool hugepages = false) {
         numthreads = nthreads;
+        uring = useuring;
+        numbuffers = nbuffers;
+        maxbytes = nbytes;
         blocksize = roundtopages(bufsize);
-        global_buffer_size = numthreads * blocksize;
+        global_buffer_size = size_t(numthreads) * numbuffers * blocksize;
+        global_map_size = global_buffer_size;
+        global_buffer = hugepages ? (char *)hugealloc(global_buffer_size, global_map_size) : nullptr;
+        prefaulted = global_buffer != nullptr;
+        if (global_buffer != nullptr) return;
+        global_map_size = global_buffer_size;
         global_buffer = (char *)vmalloc(global_buffer_size);
         int res = madvise(global_buffer, global_buffer_size, MADV_HUGEPAGE);
         if (res < 0) {
@@ -89,80 +180,377 @@ public:
     }
 
     ~PipeWriter() {
-        vmfree(global_buffer, global_buffer_size);
+        vmfree(global_buffer, global_map_size);
     }
 
-    /** Thread runnable method to printout buffers in the queue and free main thread */
-    void run() {
-        int res = ::setvbuf(stdout, NULL, _IONBF, 0);
-        if (res != 0) {
-            int err = errno;
-            std::cerr << "Failed removing buffer from stdout: " << strerror(err) << std::endl;
-        }
-        uint32_t fd = fileno(stdout);
+    /** Size of the pages that actually back the buffers */
+    size_t pagesize() const {
+        return backingpagesize(global_buffer);
+    }
+
+    /** Returns true once the writer is done, either by reaching the end of the range or by an error */
+    bool stopped() const {
+        return done.load(std::memory_order_acquire);
+    }
+
+    /** Publishes every write into p, and stops writing between two writes once p asks to */
+    void track(Progress *p) {
+        progress = p;
+    }
+
+    /** Treats the output as a listening socket and streams to every client that connects, see runServer() */
+    void serve(uint64_t lag) {
+        maxlag = lag;
+    }
+
+    /** Returns true once asked to stop, nothing else is written after that */
+    bool halted() const {
+        return (progress != nullptr) && progress->stop.load(std::memory_order_relaxed);
+    }
+
+    /** Accounts for nbytes written out, the prefix a checkpoint can resume after */
+    void delivered(uint64_t nbytes) {
+        if (progress != nullptr) progress->delivered.store(nbytes, std::memory_order_release);
+    }
+
+    /** Prints out chunks in sequence into outfd until the one that ends the range,
+     * the byte limit is reached or the output goes away. Returns false on write errors. */
+    bool run(int outfd) {
+        fd = outfd;
         int32_t maxpipe = getmaxpipe();
         uint32_t desiredsize = maxpipe;
-        bool haspipe = ::fcntl(fd, F_SETPIPE_SZ, desiredsize) >= 0;
+        haspipe = ::fcntl(fd, F_SETPIPE_SZ, desiredsize) >= 0;
         int32_t pipesize = ::fcntl(fd, F_GETPIPE_SZ);
 
-        std::cerr << "This:" << this << " MaxPipe:" << maxpipe << " stdout:" << pipesize << std::endl;
-        while (true) {
-            Data data = popqueue();
+        std::cerr << "This:" << this << " MaxPipe:" << maxpipe << " fd:" << fd << " pipe:" << pipesize << std::endl;
+        telemetry = Telemetry::instance().claim("writer");
+        timer.publish(telemetry);
+        if (telemetry != nullptr) telemetry->pipesize.store(haspipe ? pipesize : 0, std::memory_order_relaxed);
+        if (maxlag > 0) {
+            runServer();
+        } else if (!uring || !runUring()) {
+            runSyscalls();
+        }
+        done.store(true, std::memory_order_release);
+        return !error;
+    }
+
+    /** Classic loop, one blocking vmsplice() or write() per chunk */
+    void runSyscalls() {
+        while (!closed && (total < maxbytes) && !halted()) {
+            Buffer *b = popqueue();
+            if (b == nullptr) break;
+            uint32_t size = b->used;
             // Sanity check
-            // sanity(data.data);
+            // sanity(b->data);
+            if (size > maxbytes - total) {
+                size = maxbytes - total;
+            }
 #if 0
-            ssize_t nb = data.size;
+            ssize_t nb = size;
 #else
             ssize_t nb = 0;
             if (!haspipe) {
-                while (nb < data.size) {
-                    ssize_t res = ::write(fd, &data.data[nb], data.size - nb);
+                while (nb < size) {
+                    ssize_t res = ::write(fd, &b->data[nb], size - nb);
                     if (res >= 0) {
                         nb += res;
-                    } else if (errno != EAGAIN) {
-                        int err = errno;
-                        std::cerr << "Error in write() nbytes:" << res << " error:" << strerror(err) << std::endl;
+                        delivered(total + nb);
+                    } else if (errno != EAGAIN && errno != EINTR) {
+                        fail("write()", res);
+                        break;
                     }
                 }
             } else {
-                while (nb < data.size) {
+                while (nb < size) {
                     iovec iov;
-                    iov.iov_base = &data.data[nb];
-                    iov.iov_len = data.size - nb;
-                    if (iov.iov_len > pipesize) {
-                        // iov.iov_len = pipesize;
-                    }
+                    iov.iov_base = &b->data[nb];
+                    iov.iov_len = size - nb;
                     ssize_t res;
                     res = ::vmsplice(fd, &iov, 1, 0);
 
                     if (res > 0) {
                         nb += res;
+                        delivered(total + nb);
                     } else if (res == 0) {
                         break;
-                    } else if (errno != EAGAIN) {
-                        int err = errno;
-                        std::cerr << "Error in vmsplice nbytes:" << res << " error:" << strerror(err) << std::endl;
+                    } else if (errno != EAGAIN && errno != EINTR) {
+                        fail("vmsplice", res);
+                        break;
                     }
                 }
             }
-            if (nb != data.size) {
-                std::cerr << "vmsplice expected " << data.size << " got " << nb << " bytes" << std::endl;
+            if (!closed && nb != size) {
+                std::cerr << "vmsplice expected " << size << " got " << nb << " bytes" << std::endl;
             }
 #endif
-            // Releases the thread
-            data.flag.store(0, std::memory_order_release);
+            total += nb;
+            b->end = total;
+            if (telemetry != nullptr) telemetry->bytes.store(total, std::memory_order_relaxed);
+            inflight.push_back(b);
+            recycle();
+            if (b->eof) break;
         }
     }
 
-    /** Requests a free new or recycled buffer to be worked on */
-    BufferPtr request() {
-        uint32_t idx = avail.size();
-        BufferPtr b(new Buffer);
-        b->index = idx;
-        b->size = blocksize;
-        b->data = &global_buffer[idx * roundtopages(blocksize)];
-        b->flag.store(0);
-        avail.push_back(b);
-        return b;
+#ifdef FIZZBUZZ_URING
+    /** One write kept in flight by io_uring */
+    struct Write {
+        Buffer *buffer;  //! Chunk being written, goes back to its generator once complete
+        uint32_t size;   //! Bytes to write, less than used if cut by the byte limit
+        uint32_t done;   //! Bytes already written
+        int64_t offset;  //! File offset of the chunk, -1 on pipes
+        bool reissue;    //! Came back short or cancelled, has to be submitted again
+    };
+
+    /** io_uring loop: keeps up to one write per buffer in flight and releases buffers from the
+     * completion events. Files get positioned writes completing in any order. Pipes have no offsets
+     * so each batch is a linked chain and the next batch waits for the previous one.
+     * Returns false if io_uring is not available, before touching any chunk. */
+    bool runUring() {
+        IoUring ring;
+        if (!ring.init(numthreads * numbuffers)) {
+            int err = errno;
+            std::cerr << "io_uring not available (" << strerror(err) << "), using blocking calls" << std::endl;
+            return false;
+        }
+        off_t position = ::lseek(fd, 0, SEEK_CUR);
+        bool ordered = haspipe || (position < 0) || ((::fcntl(fd, F_GETFL) & O_APPEND) != 0);
+        std::deque<Write> writes;  // In submission order, user_data is firstid plus the index
+        uint64_t firstid = 0;
+        uint64_t queued = 0;       // Bytes handed to the ring so far
+        uint32_t running = 0;      // Submitted and not completed yet
+        uint32_t stalled = 0;      // Waiting to be reissued
+        bool last = false;         // The chunk that ends the range was queued
+
+        auto issue = [&](Write &w, uint64_t id) {
+            int64_t offset = w.offset < 0 ? -1 : w.offset + w.done;
+            ring.write(fd, &w.buffer->data[w.done], w.size - w.done, offset, id, ordered);
+            w.reissue = false;
+            running++;
+        };
+        while (!closed) {
+            // Queues every chunk that is ready, only blocking if there is nothing else to wait for
+            bool accepting = (stalled == 0) && (!ordered || (running == 0)) && !halted();
+            while (accepting && !last && (queued < maxbytes) && (writes.size() < ring.depth())) {
+                Buffer *b = writes.empty() ? popqueue() : trypop();
+                if (b == nullptr) break;
+                uint64_t size = b->used < maxbytes - queued ? b->used : maxbytes - queued;
+                writes.push_back({b, uint32_t(size), 0, ordered ? -1 : int64_t(position + queued), false});
+                queued += size;
+                last = b->eof;
+                issue(writes.back(), firstid + writes.size() - 1);
+            }
+            if (writes.empty()) break;
+
+            int res = ring.enter(1);
+            if ((res < 0) && (errno != EINTR) && (errno != EAGAIN) && (errno != EBUSY)) {
+                fail("io_uring_enter", res);
+                break;
+            }
+            uint64_t id;
+            int32_t result;
+            while (ring.reap(id, result)) {
+                Write &w(writes[id - firstid]);
+                running--;
+                if ((result == -ECANCELED) || (result == -EAGAIN) || (result == -EINTR)) {
+                    w.reissue = true;
+                } else if (result <= 0) {
+                    errno = result < 0 ? -result : EIO;
+                    fail("io_uring write", result);
+                } else {
+                    w.done += result;
+                    w.reissue = w.done < w.size;
+                }
+                if (w.reissue) stalled++;
+            }
+
+            // Retires the writes at the front that are complete, in order
+            while (!writes.empty() && (writes.front().done == writes.front().size)) {
+                Buffer *b = writes.front().buffer;
+                total += writes.front().size;
+                if (telemetry != nullptr) telemetry->bytes.store(total, std::memory_order_relaxed);
+                channels[b->index]->empty.push(b);
+                writes.pop_front();
+                firstid++;
+            }
+            delivered(total + (writes.empty() ? 0 : writes.front().done));
+            // A short write cancels the rest of its chain, restart from there once it fully drained
+            if ((stalled > 0) && (running == 0) && !closed) {
+                for (uint32_t j = 0; j < writes.size(); ++j) {
+                    if (writes[j].reissue) issue(writes[j], firstid + j);
+                }
+                stalled = 0;
+            }
+        }
+        // The kernel might still be reading from our buffers
+        while (running > 0) {
+            ring.enter(1);
+            uint64_t id;
+            int32_t result;
+            while (ring.reap(id, result)) running--;
+        }
+        return true;
+    }
+#else
+    bool runUring() {
+        std::cerr << "Built without io_uring support, using blocking calls" << std::endl;
+        return false;
+    }
+#endif
+
+    /** A consumer connected to the server */
+    struct Client {
+        int fd;         //! Connected socket, non blocking
+        uint64_t sent;  //! Stream offset of the next byte it gets
+        bool blocked;   //! Its socket buffer is full, waiting for POLLOUT
+    };
+
+    /** Closes a client, with the reason on stderr unless it simply went away */
+    void drop(Client &client, const char *reason) {
+        if (reason != nullptr) {
+            std::cerr << "Client " << client.fd << " " << reason << " at byte " << client.sent << ", "
+                      << total - client.sent << " bytes behind" << std::endl;
+        }
+        ::close(client.fd);
+        client.fd = -1;
+    }
+
+    /** Sends a client as much of the retained chunks as its socket takes, straight from the buffers.
+     * Returns true if anything was sent. */
+    bool push(Client &client) {
+        const uint32_t MAXIOV = 64;
+        iovec iov[MAXIOV];
+        uint32_t count = 0;
+        auto it = std::upper_bound(inflight.begin(), inflight.end(), client.sent,
+                                   [](uint64_t pos, const Buffer *b) { return pos < b->end; });
+        for (; (it != inflight.end()) && (count < MAXIOV); ++it, ++count) {
+            uint64_t begin = (*it)->end - (*it)->used;
+            uint64_t skip = client.sent > begin ? client.sent - begin : 0;
+            iov[count].iov_base = (*it)->data + skip;
+            iov[count].iov_len = (*it)->used - skip;
+        }
+        msghdr msg{};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        ssize_t res = ::sendmsg(client.fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (res > 0) {
+            client.sent += res;
+            return true;
+        }
+        if ((errno == EAGAIN) || (errno == EINTR)) {
+            client.blocked = errno == EAGAIN;
+        } else {
+            int err = errno;
+            drop(client, (err == EPIPE) || (err == ECONNRESET) ? nullptr : strerror(err));
+        }
+        return false;
+    }
+
+    /** Fans the stream out to every client of the listening socket in fd. The stream is generated
+     * once, the chunks written stay in their buffers until every client got them and each client
+     * is sent from there at its own pace. New chunks are taken as long as the fastest client keeps
+     * up, so a client that lags more than maxlag bytes behind is dropped: it can reconnect and picks
+     * up the live stream from the next chunk, like every new client. No chunk is taken while nobody
+     * is connected. AF_UNIX sockets have no zero copy path, this is their single copy. */
+    void runServer() {
+        std::vector<Client> clients;
+        std::vector<pollfd> fds;
+        bool last = false;
+        Backoff backoff;
+        while (!halted()) {
+            bool busy = false;
+            clients.erase(std::remove_if(clients.begin(), clients.end(), [](const Client &c) { return c.fd < 0; }),
+                          clients.end());
+            for (int cfd; (cfd = ::accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0; busy = true) {
+                clients.push_back({cfd, total, false});
+                std::cerr << "Client " << cfd << " connected at byte " << total << std::endl;
+            }
+
+            // Takes chunks while the fastest client is within a buffer of the end, they were generated meanwhile
+            uint64_t lead = 0;
+            for (const Client &client : clients) lead = client.sent > lead ? client.sent : lead;
+            while (!clients.empty() && !last && (total < maxbytes) && (total - lead < blocksize)) {
+                Buffer *b = trypop();
+                if (b == nullptr) break;
+                if (b->used > maxbytes - total) b->used = maxbytes - total;
+                total += b->used;
+                b->end = total;
+                last = b->eof || (total == maxbytes);
+                inflight.push_back(b);
+                busy = true;
+            }
+            if (telemetry != nullptr) telemetry->bytes.store(total, std::memory_order_relaxed);
+
+            // Sends, then drops the clients that lag too far or went away. The window is also cut short
+            // when the generators run out of buffers while the fastest client is past the oldest one.
+            uint64_t lowest = total;
+            bool waiting = false;
+            bool starved = !inflight.empty() && (inflight.size() + channels.size() >= channels.size() * numbuffers) &&
+                           (lead >= inflight.front()->end);
+            for (Client &client : clients) {
+                if (client.fd < 0) continue;
+                if ((client.sent < total) && !client.blocked) busy = push(client) || busy;
+                if ((client.fd >= 0) && (total - client.sent > maxlag)) drop(client, "fell behind the window");
+                if ((client.fd >= 0) && starved && (client.sent < inflight.front()->end)) {
+                    drop(client, "held back all the buffers");
+                }
+                if (client.fd < 0) continue;
+                lowest = client.sent < lowest ? client.sent : lowest;
+                waiting = waiting || (client.sent == total);
+            }
+            while (!inflight.empty() && (inflight.front()->end <= lowest)) {
+                Buffer *b = inflight.front();
+                inflight.pop_front();
+                channels[b->index]->empty.push(b);
+            }
+            if (last && (lowest == total)) break;
+            if (busy) {
+                backoff = Backoff();
+                continue;
+            }
+
+            // Idle: sleeps on the sockets if they hold us back, otherwise the generators are about to deliver
+            fds.assign(1, pollfd{fd, POLLIN, 0});
+            for (const Client &client : clients) fds.push_back({client.fd, short(client.blocked ? POLLOUT : 0), 0});
+            bool generating = waiting && !last && (total < maxbytes);
+            if (::poll(fds.data(), fds.size(), generating ? 0 : 10) > 0) {
+                for (uint32_t j = 1; j < fds.size(); ++j) {
+                    if ((fds[j].revents & (POLLERR | POLLHUP)) != 0) {
+                        drop(clients[j - 1], nullptr);
+                    } else if ((fds[j].revents & POLLOUT) != 0) {
+                        clients[j - 1].blocked = false;
+                    }
+                }
+            }
+            if (generating) backoff.pause();
+        }
+        for (Client &client : clients) {
+            if (client.fd >= 0) ::close(client.fd);
+        }
+    }
+
+    /** Creates the channel for a new generator, with its share of buffers ready to be worked on.
+     * The buffers are contiguous and still untouched, so with a node they get bound there first. */
+    Channel &attach(int node = -1) {
+        uint32_t owner = channels.size();
+        channels.emplace_back(new Channel(numbuffers));
+        window.resize(window.size() + numbuffers, nullptr);
+        for (uint32_t j = 0; j < numbuffers; ++j) {
+            uint32_t idx = avail.size();
+            BufferPtr b(new Buffer);
+            b->index = owner;
+            b->size = blocksize;
+            b->data = &global_buffer[size_t(idx) * blocksize];
+            b->eof = false;
+            b->seq = 0;
+            b->end = 0;
+            avail.push_back(b);
+            channels[owner]->empty.push(b.get());
+        }
+        char *share = &global_buffer[size_t(owner) * numbuffers * blocksize];
+        bindnode(share, size_t(numbuffers) * blocksize, node);
+        if (prefaulted) prefault(share, size_t(numbuffers) * blocksize);
+        return *channels[owner];
     }
 };
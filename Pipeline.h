@@ -0,0 +1,105 @@
+#pragma once
+
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "Checkpoint.h"
+#include "PipeWriter.h"
+#include "Generator.h"
+#include "Rules.h"
+#include "FileWriter.h"
+#include "Scheduler.h"
+#include "Topology.h"
+
+/** Command line knobs shared by every output */
+struct Options {
+    uint32_t numthreads = 1;       //! Generator threads per output
+    uint32_t numblocks = 1;        //! Blocks of 15 numbers per chunk, other rules get about as many numbers
+    uint32_t numbuffers = 4;       //! Buffers owned by each generator
+    bool uring = false;            //! Write pipes and files through io_uring
+    bool direct = false;           //! O_DIRECT for regular files
+    bool mapped = false;           //! Render in place into the mapped output file
+    bool hugepages = false;        //! Prefaulted huge page buffers
+    std::string pin;               //! Thread placement policy, see Topology
+    Rules rules;                   //! What to print, 3:Fizz,5:Buzz by default
+    Progress *progress = nullptr;  //! Tracks the bytes delivered for checkpoints, and stops the output on request
+    uint64_t window = 0;           //! The output is a listening socket, clients can lag this many bytes behind
+};
+
+/** Prints the numbers from..to, cut after maxbytes bytes, into the output fd with its own scheduler,
+ * generator threads and writer. Several of these can run side by side on different outputs.
+ * The first skip bytes of the line from are left out, to resume a run stopped in the middle of it.
+ * Returns false on errors. */
+static bool pipeline(int fd, uint128_t from, uint128_t to, uint64_t maxbytes, const Options &opt, uint32_t skip = 0) {
+    const Rules &rules(opt.rules);
+    uint32_t numbuffers = opt.numbuffers;
+    // Chunks cover about the same numbers whatever the period so buffers stay in the same ballpark
+    uint64_t numblocks = uint64_t(opt.numblocks) * 15 / rules.period;
+    if (numblocks == 0) numblocks = 1;
+    uint32_t bufsize = numblocks * rules.blockSize(rules.format.maxWidth()) + 1;  // Widest blocks plus sprintf's null
+    Scheduler scheduler(rules.blockBase(from), rules.blockBase(to), numblocks, rules.period);
+
+    // Regular files are written in parallel by the generators themselves, one buffer each
+    FileWriter file(fd, from, skip, maxbytes, rules);
+    file.track(opt.progress);
+    bool positioned = file.open(opt.direct);
+    if (positioned) {
+        bufsize += DIRECTALIGN;
+        numbuffers = 1;
+    }
+
+    // Serving clients, the buffers also hold the window the slowest client can lag behind.
+    // Sized with the chunks found one window into the range, the smaller ones before can run out
+    // of buffers first, then the writer cuts the window short.
+    if (opt.window > 0) {
+        uint64_t chunksize = numblocks * rules.blockSize(rules.fieldWidth(rules.offsetLine(from, opt.window)));
+        numbuffers += (opt.window / chunksize + opt.numthreads) / opt.numthreads + 1;
+    }
+
+    // Or sized up front and mapped so the generators render in place
+    if (opt.mapped) {
+        if (!positioned || ((to == rules.maxLine()) && (maxbytes == std::numeric_limits<uint64_t>::max()))) {
+            std::cerr << "--mmap needs the output to be a regular file and the range bounded by --to or --bytes"
+                      << std::endl;
+            return false;
+        }
+        uint128_t size = rules.rangeBytes(from, to) - skip;
+        if (!file.map(size < maxbytes ? uint64_t(size) : maxbytes)) return false;
+    }
+
+    // The writer runs on this thread, pinned first so generators can be placed around it
+    std::vector<int> cpus = Topology::instance().place(opt.pin, opt.numthreads, !positioned);
+    if (!cpus.empty()) {
+        std::ostringstream oss;
+        oss << "Pinned";
+        if (!positioned) oss << " writer:" << cpus[0];
+        oss << " generators:";
+        for (uint32_t j = positioned ? 0 : 1; j < cpus.size(); ++j) {
+            oss << cpus[j] << (j + 1 < cpus.size() ? "," : "");
+        }
+        std::cerr << oss.str() << std::endl;
+        if (!positioned) pincpu(cpus[0]);
+    }
+
+    using GeneratorPtr = std::shared_ptr<Generator>;
+    std::vector<GeneratorPtr> loops;
+    PipeWriter writer(opt.numthreads, bufsize, numbuffers, maxbytes, opt.uring, opt.hugepages);
+    writer.track(opt.progress);
+    if (opt.window > 0) writer.serve(opt.window);
+    for (uint32_t j = 0; j < opt.numthreads; ++j) {
+        int cpu = cpus.empty() ? -1 : cpus[j + (positioned ? 0 : 1)];
+        GeneratorPtr loop(
+            new Generator(writer, scheduler, positioned ? &file : nullptr, numblocks, from, to, rules, cpu, skip));
+        loops.push_back(loop);
+    }
+    if (opt.hugepages) std::cerr << "Buffers on " << writer.pagesize() / 1024 << "KB pages" << std::endl;
+    bool ok = true;
+    if (!positioned) ok = writer.run(fd);
+    loops.clear();
+    if (positioned) ok = file.ok();
+    return ok;
+}
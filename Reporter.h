@@ -0,0 +1,73 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/** Anything with stats to print from the reporter thread */
+class Reportable {
+public:
+    virtual ~Reportable() {
+    }
+
+    /** Called from the reporter thread every few milliseconds, prints if its interval is over */
+    virtual void report() = 0;
+};
+
+/**
+ * A single background thread that snapshots, formats and prints the stats of every registered
+ * Reportable on its own schedule. The threads that record the stats only bump counters, they
+ * never format strings, write to stderr or read the wall clock, so printing cannot stall them.
+ */
+class Reporter {
+public:
+    /** Started with the first registration, stopped at exit */
+    static Reporter &instance() {
+        static Reporter reporter;
+        return reporter;
+    }
+
+    ~Reporter() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        wakeup.notify_all();
+        if (thread.joinable()) thread.join();
+    }
+
+    void add(Reportable *source) {
+        std::lock_guard<std::mutex> lock(mutex);
+        sources.push_back(source);
+        if (!thread.joinable()) thread = std::thread(&Reporter::run, this);
+    }
+
+    /** Once this returns the reporter is not inside source anymore and will not call it again */
+    void remove(Reportable *source) {
+        std::lock_guard<std::mutex> lock(mutex);
+        sources.erase(std::remove(sources.begin(), sources.end(), source), sources.end());
+    }
+
+private:
+    static constexpr uint32_t POLLMS = 100;  //! How often the sources are asked to report
+
+    std::mutex mutex;                   //! Guards sources and stop, held while reporting
+    std::condition_variable wakeup;     //! Cuts the sleep short at exit
+    std::vector<Reportable *> sources;  //! Registered sources
+    bool stop = false;                  //! Raised at exit
+    std::thread thread;                 //! The reporter thread
+
+    Reporter() {
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stop) {
+            wakeup.wait_for(lock, std::chrono::milliseconds(POLLMS));
+            for (Reportable *source : sources) source->report();
+        }
+    }
+};
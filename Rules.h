@@ -0,0 +1,311 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "NumericUtils.h"
+
+/** One divisor and the word printed for its multiples */
+struct Rule {
+    uint64_t divisor;  //! Multiples of this number print the word
+    std::string word;  //! Printed without separator, several words on a line follow the rule order
+};
+
+/** Shape of every line: [number delimiter] label separator, where the label is the words or the number */
+struct Format {
+    std::string separator = "\n";  //! Ends every line, its last byte is where readers split lines
+    std::string delimiter;         //! When set, every line starts with its number and this, as in "3:Fizz"
+    uint32_t width = 0;            //! Fixed width of every field, numbers zero padded and words space padded
+    uint32_t radix = 10;           //! Numbers are printed in base 8, 10 or 16 (lowercase)
+
+    /** Named separators lf, crlf and nul, anything else is taken literally */
+    static std::string separatorText(const std::string &name) {
+        if (name == "lf") return "\n";
+        if (name == "crlf") return "\r\n";
+        if (name == "nul") return std::string(1, '\0');
+        return name;
+    }
+
+    /** True for plain lines ended with a newline, the layout of the compile time templates */
+    bool standard() const {
+        return (separator == "\n") && delimiter.empty() && (width == 0) && (radix == 10);
+    }
+
+    /** Digits of the largest 128 bit number in the radix */
+    uint32_t maxWidth() const {
+        return radixdigits(UINT128MAX, radix);
+    }
+
+    /** Last byte of every line */
+    char terminator() const {
+        return separator.back();
+    }
+
+    /** Width of a number field holding a number of ndigits digits */
+    uint32_t fieldWidth(uint32_t ndigits) const {
+        return width > 0 ? width : ndigits;
+    }
+};
+
+/**
+ * A generalized fizzbuzz: a number that is a multiple of some divisors prints the words of all of
+ * them, in rule order, the others print themselves. The output repeats its layout every
+ * LCM(divisors) lines, so a block covers one period, starts at k*period+1 and all the blocks of the
+ * same digit width have the same size. Holds that layout, with the lines shaped by a Format, and the
+ * size formulas derived from it, the runtime counterparts of blockSize(), lineOffset() and friends
+ * in NumericUtils.h. A block is kept as constant text around its number fields, so a line can hold
+ * none, one (the label or the prefix) or two of them. The default is the classic 3:Fizz,5:Buzz.
+ */
+struct Rules {
+    static const uint32_t MAXPERIOD = 65536;  //! Longest block we are willing to hold as a template
+
+    std::vector<Rule> rules;             //! As given
+    Format format;                       //! Shape of the lines
+    uint32_t period;                     //! Lines in a block, LCM of all the divisors
+    std::vector<std::string> words;      //! Label of every line of the block, empty where it is the number
+    std::vector<std::string> literals;   //! Constant text before every number field, then after the last one
+    std::vector<uint32_t> numbers;       //! Line of the block of every number field, in order
+    std::vector<uint64_t> fieldcount;    //! Number fields in the first k lines of a block
+    std::vector<uint64_t> literalbytes;  //! Bytes of constant text in the first k lines of a block
+    std::vector<uint128_t> epochbytes;   //! Bytes of the number fields of all the narrower epochs, modulo 2^128
+    std::vector<uint128_t> powers;       //! Powers of the radix that fit 128 bits, where the epochs start
+
+    Rules() : Rules({{3, "Fizz"}, {5, "Buzz"}}) {
+    }
+
+    /** Both have to be validated first, see parse() and valid() */
+    explicit Rules(const std::vector<Rule> &list, const Format &fmt = Format())
+        : rules(list), format(fmt), period(1) {
+        for (const Rule &rule : rules) period = lcm(period, rule.divisor);
+        words.resize(period);
+        fieldcount.resize(period + 1, 0);
+        literalbytes.resize(period + 1, 0);
+        std::string text;
+        for (uint32_t j = 0; j < period; ++j) {
+            // Line j of every block prints a number congruent to j+1
+            for (const Rule &rule : rules) {
+                if ((j + 1) % rule.divisor == 0) words[j] += rule.word;
+            }
+            uint64_t bytes = format.delimiter.size() + format.separator.size();
+            if (!format.delimiter.empty()) {
+                field(text, j);
+                text += format.delimiter;
+            }
+            if (words[j].empty()) {
+                field(text, j);
+            } else {
+                std::string label(words[j]);
+                if (label.size() < format.width) label.append(format.width - label.size(), ' ');
+                text += label;
+                bytes += label.size();
+            }
+            text += format.separator;
+            fieldcount[j + 1] = numbers.size();
+            literalbytes[j + 1] = literalbytes[j] + bytes;
+        }
+        literals.push_back(text);
+        uint32_t maxwidth = format.maxWidth();
+        for (uint128_t power = 1; powers.size() < maxwidth; power *= format.radix) powers.push_back(power);
+        epochbytes.resize(maxwidth + 1, 0);
+        for (uint32_t d = 1; d < maxwidth; ++d) {
+            epochbytes[d + 1] = epochbytes[d] + d * (countFields(powers[d] - 1) - countFields(powers[d - 1] - 1));
+        }
+    }
+
+    /** Parses "3:Fizz,5:Buzz,7:Bazz". Returns false, reported on stderr, if the rules are not usable. */
+    static bool parse(const std::string &text, std::vector<Rule> &list) {
+        std::stringstream ss(text);
+        std::string item;
+        uint64_t period = 1;
+        list.clear();
+        while (std::getline(ss, item, ',')) {
+            size_t colon = item.find(':');
+            char *end = nullptr;
+            uint64_t divisor = colon != std::string::npos ? std::strtoull(item.c_str(), &end, 10) : 0;
+            if ((divisor == 0) || (end != item.c_str() + colon) || (colon + 1 == item.size())) {
+                std::cerr << "Bad rule [" << item << "], expected divisor:word" << std::endl;
+                return false;
+            }
+            period = divisor > MAXPERIOD ? divisor : lcm(period, divisor);
+            if (period > MAXPERIOD) {
+                std::cerr << "The rules repeat every " << period << " lines or more, the limit is " << MAXPERIOD
+                          << std::endl;
+                return false;
+            }
+            list.push_back({divisor, item.substr(colon + 1)});
+        }
+        if (list.empty()) {
+            std::cerr << "No rules in [" << text << "]" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    /** Returns false, reported on stderr, if lines could not be told apart or do not fit the fixed width */
+    static bool valid(const std::vector<Rule> &list, const Format &format) {
+        if (format.separator.empty()) {
+            std::cerr << "The line separator cannot be empty" << std::endl;
+            return false;
+        }
+        if ((format.radix != 8) && (format.radix != 10) && (format.radix != 16)) {
+            std::cerr << "Numbers can only be printed in base 8, 10 or 16" << std::endl;
+            return false;
+        }
+        if (format.width > format.maxWidth()) {
+            std::cerr << "Fields are at most " << format.maxWidth() << " characters wide, the widest 128 bit number"
+                      << std::endl;
+            return false;
+        }
+        char eol = format.terminator();
+        std::string words;
+        for (const Rule &rule : list) words += rule.word;
+        std::string head = format.separator.substr(0, format.separator.size() - 1);
+        for (const std::string &text : {words, format.delimiter, head}) {
+            if (text.find(eol) != std::string::npos) {
+                std::cerr << "[" << text << "] contains the end of line character" << std::endl;
+                return false;
+            }
+        }
+        if ((format.width > 0) && (words.size() > format.width)) {
+            std::cerr << "The words of a line can take " << words.size() << " characters, wider than "
+                      << format.width << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    /** True for 3:Fizz,5:Buzz in plain lines, which has its own compile time templates */
+    bool standard() const {
+        return (rules.size() == 2) && (rules[0].divisor == 3) && (rules[0].word == "Fizz") &&
+               (rules[1].divisor == 5) && (rules[1].word == "Buzz") && format.standard();
+    }
+
+    /** FNV-1a hash of everything that shapes the output, two rule sets print the same bytes if they match */
+    uint64_t fingerprint() const {
+        uint64_t hash = 14695981039346656037ULL;
+        auto mix = [&hash](const void *data, size_t size) {
+            for (size_t j = 0; j < size; ++j) hash = (hash ^ ((const uint8_t *)data)[j]) * 1099511628211ULL;
+        };
+        for (const std::string &text : literals) mix(text.data(), text.size() + 1);
+        mix(numbers.data(), numbers.size() * sizeof(uint32_t));
+        mix(&format.width, sizeof(format.width));
+        mix(&format.radix, sizeof(format.radix));
+        return hash;
+    }
+
+    /** Size of a block where all the numbers have ndigits digits */
+    uint32_t blockSize(uint32_t ndigits) const {
+        return literalbytes[period] + numbers.size() * format.fieldWidth(ndigits);
+    }
+
+    /** Counts the number fields printed by the lines [1,num] */
+    uint128_t countFields(uint128_t num) const {
+        return (num / period) * numbers.size() + fieldcount[num % period];
+    }
+
+    /** Bytes of constant text printed by the lines [1,num] */
+    uint128_t countLiteralBytes(uint128_t num) const {
+        return (num / period) * literalbytes[period] + literalbytes[num % period];
+    }
+
+    /** O(1) byte offset in the output of the line that prints the number `line` (1-based), modulo 2^128.
+     * The offsets of the widest numbers do not fit but the formula only adds and multiplies, so
+     * the distance between two lines is exact whenever it fits. Only use differences. */
+    uint128_t lineOffset(uint128_t line) const {
+        uint128_t m = line - 1;
+        if (m == 0) return 0;
+        if (format.width > 0) return countLiteralBytes(m) + format.width * countFields(m);
+        uint32_t numdigits = numDigits(m);
+        uint128_t low = powers[numdigits - 1];
+        return countLiteralBytes(m) + epochbytes[numdigits] + numdigits * (countFields(m) - countFields(low - 1));
+    }
+
+    /** Returns the size in bytes of the single line that prints the number `line` */
+    uint32_t lineSize(uint128_t line) const {
+        uint32_t j = (line - 1) % period;
+        return literalbytes[j + 1] - literalbytes[j] + (fieldcount[j + 1] - fieldcount[j]) * fieldWidth(line);
+    }
+
+    /** Width of the fields that print the number `line` */
+    uint32_t fieldWidth(uint128_t line) const {
+        return format.width > 0 ? format.width : numDigits(line);
+    }
+
+    /** Digits of num in the radix of the format */
+    uint32_t numDigits(uint128_t num) const {
+        return radixdigits(num, format.radix);
+    }
+
+    /** Returns the line (ie the number) holding the byte nbytes bytes past the start of the line `from`.
+     * Same walk as ::offsetLine from the epoch of `from`, with up to one period of lines left at the end.
+     * Relative since the absolute offsets wrap past 128 bits. */
+    uint128_t offsetLine(uint128_t from, uint64_t nbytes) const {
+        uint32_t numdigits = numDigits(from);
+        uint128_t low = from;
+        while (numdigits < powers.size()) {
+            // Lines take a byte at least, so a wider epoch out of reach needs no (possibly wrapped) offset
+            uint128_t next = powers[numdigits];
+            if ((next - from > nbytes) || (rangeBytes(from, next - 1) > nbytes)) break;
+            low = next;
+            numdigits++;
+        }
+        // First block that starts inside this epoch
+        uint128_t line = blockBase(low);
+        if (line < low) line += period;
+        uint128_t lineoff = lineOffset(line) - lineOffset(from);
+        if ((line - from <= nbytes) && (lineoff <= nbytes)) {
+            const uint32_t blocksize = blockSize(numdigits);
+            uint64_t nblocks = (nbytes - lineoff) / blocksize;
+            line += period * uint128_t(nblocks);
+            lineoff += blocksize * uint128_t(nblocks);
+        } else {
+            line = low;
+            lineoff = lineOffset(line) - lineOffset(from);
+        }
+        for (uint32_t size = lineSize(line); lineoff + size <= nbytes; size = lineSize(line)) {
+            lineoff += size;
+            line++;
+        }
+        return line;
+    }
+
+    /** Total number of bytes used by the lines that print the numbers from..to (inclusive), modulo 2^128.
+     * Ends with the size of the last line so `to` can be the largest 128 bit number. */
+    uint128_t rangeBytes(uint128_t from, uint128_t to) const {
+        return lineOffset(to) - lineOffset(from) + lineSize(to);
+    }
+
+    /** First number of the block that holds the number `line` */
+    uint128_t blockBase(uint128_t line) const {
+        return ((line - 1) / period) * period + 1;
+    }
+
+    /** Last number we can print, the block that holds it has to end within 128 bits */
+    uint128_t maxLine() const {
+        uint128_t base = blockBase(UINT128MAX);
+        return UINT128MAX - base >= period - 1 ? UINT128MAX : base - 1;
+    }
+
+private:
+    /** Closes the constant text before a number field of line j */
+    void field(std::string &text, uint32_t j) {
+        literals.push_back(text);
+        text.clear();
+        numbers.push_back(j);
+    }
+
+    static uint64_t gcd(uint64_t a, uint64_t b) {
+        while (b != 0) {
+            uint64_t t = a % b;
+            a = b;
+            b = t;
+        }
+        return a;
+    }
+    static uint64_t lcm(uint64_t a, uint64_t b) {
+        return a / gcd(a, b) * b;
+    }
+};
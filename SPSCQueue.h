@@ -0,0 +1,51 @@
+#pragma once
+#include <cstdint>
+#include <atomic>
+#include <vector>
+
+/** Bounded lock-free queue between exactly one producer thread and one consumer thread.
+ * Head and tail only ever grow and live on separate cache lines, each side caches the
+ * other's counter so the shared line is only read when the queue looks full or empty. */
+template <typename T>
+class SPSCQueue {
+public:
+    /** The capacity is rounded up to the next power of two */
+    SPSCQueue(uint32_t capacity) {
+        uint32_t size = 1;
+        while (size < capacity) size *= 2;
+        items.resize(size);
+        mask = size - 1;
+    }
+
+    /** Called by the producer only. Returns false if the queue is full. */
+    bool push(const T &item) noexcept {
+        uint64_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - headcache > mask) {
+            headcache = head_.load(std::memory_order_acquire);
+            if (tail - headcache > mask) return false;
+        }
+        items[tail & mask] = item;
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    /** Called by the consumer only. Returns false if the queue is empty. */
+    bool pop(T &item) noexcept {
+        uint64_t head = head_.load(std::memory_order_relaxed);
+        if (head == tailcache) {
+            tailcache = tail_.load(std::memory_order_acquire);
+            if (head == tailcache) return false;
+        }
+        item = items[head & mask];
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    std::vector<T> items;                        //! Ring storage, size is a power of two
+    uint64_t mask;                               //! Size minus one
+    alignas(64) std::atomic<uint64_t> head_{0};  //! Next item to pop, written by the consumer
+    uint64_t tailcache = 0;                      //! Consumer's last view of the tail
+    alignas(64) std::atomic<uint64_t> tail_{0};  //! Next slot to push, written by the producer
+    uint64_t headcache = 0;                      //! Producer's last view of the head
+};
@@ -0,0 +1,27 @@
+#pragma once
+#include <cstdint>
+#include <atomic>
+#include "NumericUtils.h"
+
+/** Hands out chunks of consecutive blocks, one rules period each, to the generators in sequence order.
+ * Faster threads simply claim more chunks and the writer puts them back in order,
+ * so one slow or preempted thread does not hold the others at its pace. */
+struct Scheduler {
+    uint128_t first;                            //! First number of the first chunk, has to be period*k+1
+    uint128_t lastbase;                         //! First number of the last block to generate
+    uint64_t chunksize;                         //! Numbers covered by one chunk, period per block
+    alignas(64) std::atomic<uint64_t> next{0};  //! Sequence number of the next chunk to be claimed
+
+    Scheduler(uint128_t start, uint128_t last, uint32_t numblocks, uint32_t period = 15)
+        : first(start), lastbase(last), chunksize(uint64_t(numblocks) * period) {
+    }
+
+    /** Claims the next chunk, returning its sequence number and first number.
+     * Returns false once the whole range has been handed out. */
+    bool claim(uint64_t &seq, uint128_t &base) {
+        seq = next.fetch_add(1, std::memory_order_relaxed);
+        if (seq > (lastbase - first) / chunksize) return false;
+        base = first + seq * chunksize;
+        return true;
+    }
+};
@@ -1,5 +1,6 @@
 #pragma once
 #include <atomic>
+#include <thread>
 
 /** Simple non-waiting lock (busy spinning) */
 class SpinLock {
@@ -50,3 +51,20 @@ public:
 private:
     std::atomic<bool> lock_;
 };
+
+/** Spins for a little while and then starts yielding the core. For waits on something that needs
+ * the CPU we are spinning on, like the pipe reader when there are fewer cores than threads. */
+class Backoff {
+public:
+    void pause() noexcept {
+        if (spins < 64) {
+            spins++;
+            __builtin_ia32_pause();
+        } else {
+            std::this_thread::yield();
+        }
+    }
+
+private:
+    uint32_t spins = 0;
+};
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <atomic>
+#include <iostream>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "Chronometer.h"
+
+/** Counters of one thread, in their own cache lines so only that thread ever writes them */
+struct alignas(64) TelemetrySlot {
+    static constexpr uint32_t NUMSTEPS = 2;  //! Steps timed by the LapTimer of the thread
+    char name[16];                           //! Kind of thread, eg "writer" or "generator"
+    char steps[NUMSTEPS][16];                //! Names of the timed steps, from the LapTimer
+    std::atomic<uint64_t> ticks[NUMSTEPS];   //! TSC ticks spent in every step
+    std::atomic<uint64_t> laps;              //! Times the sequence started over
+    std::atomic<uint64_t> bytes;             //! Bytes this thread wrote to the output
+    std::atomic<uint64_t> number;            //! Last number rendered, generators only, saturated past 64 bits
+    std::atomic<uint64_t> unread;            //! Bytes sitting in the pipe, writers only
+    std::atomic<uint64_t> pipesize;          //! Capacity of the pipe, writers only
+};
+
+/** Layout of the shared memory segment. Only the counters change after startup. */
+struct TelemetrySegment {
+    static constexpr uint64_t MAGIC = 0x315441545342465AULL;  //! "ZFBSTAT1"
+    static constexpr uint32_t MAXSLOTS = 256;                 //! Threads that can publish
+    uint64_t magic;                                           //! Written last, once the header is complete
+    uint64_t tickspersec;                                     //! Calibrated TSC frequency of the writer
+    uint64_t startns;                                         //! CLOCK_REALTIME at startup
+    int32_t pid;                                              //! Process publishing
+    std::atomic<uint32_t> numslots;                           //! Slots handed out so far
+    TelemetrySlot slots[MAXSLOTS];                            //! One per publishing thread
+};
+
+/**
+ * Publishes live counters of the running process to a named POSIX shared memory segment
+ * (/dev/shm/fizzbuzz.<pid> by default) so fbstat can watch it without touching stderr.
+ * Every thread claims a slot and only writes there, with relaxed stores. Without open()
+ * slots are null and publishers skip their counters.
+ */
+class Telemetry {
+public:
+    static Telemetry &instance() {
+        static Telemetry telemetry;
+        return telemetry;
+    }
+
+    ~Telemetry() {
+        close();
+    }
+
+    /** Default segment name for this process */
+    static std::string defaultname() {
+        return "/fizzbuzz." + std::to_string(::getpid());
+    }
+
+    /** Creates and maps the segment. Returns false, reported on stderr, if it could not. */
+    bool open(const std::string &segname) {
+        name = segname[0] == '/' ? segname : "/" + segname;
+        int fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            int err = errno;
+            std::cerr << "Could not create the telemetry segment " << name << ": " << strerror(err) << std::endl;
+            return false;
+        }
+        void *ptr = MAP_FAILED;
+        if (::ftruncate(fd, sizeof(TelemetrySegment)) == 0) {
+            ptr = ::mmap(nullptr, sizeof(TelemetrySegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        int err = errno;
+        ::close(fd);
+        if (ptr == MAP_FAILED) {
+            std::cerr << "Could not map the telemetry segment " << name << ": " << strerror(err) << std::endl;
+            ::shm_unlink(name.c_str());
+            return false;
+        }
+        // The new file is zero filled, which is a valid state for every counter
+        TelemetrySegment *seg = (TelemetrySegment *)ptr;
+        seg->tickspersec = tickspersec();
+        seg->startns = now() * 1000000;
+        seg->pid = ::getpid();
+        __atomic_store_n(&seg->magic, TelemetrySegment::MAGIC, __ATOMIC_RELEASE);
+        segment = seg;
+        return true;
+    }
+
+    /** Unmaps and removes the segment */
+    void close() {
+        if (segment == nullptr) return;
+        ::munmap(segment, sizeof(TelemetrySegment));
+        ::shm_unlink(name.c_str());
+        segment = nullptr;
+    }
+
+    /** Removes the segment name only, safe from a signal handler */
+    void unlink() {
+        if (segment != nullptr) ::shm_unlink(name.c_str());
+    }
+
+    /** Claims a slot for the calling thread. Returns null without a segment or once all slots are taken. */
+    TelemetrySlot *claim(const char *kind) {
+        if (segment == nullptr) return nullptr;
+        uint32_t idx = segment->numslots.load(std::memory_order_relaxed);
+        do {
+            if (idx >= TelemetrySegment::MAXSLOTS) return nullptr;
+        } while (!segment->numslots.compare_exchange_weak(idx, idx + 1, std::memory_order_relaxed));
+        TelemetrySlot *slot = &segment->slots[idx];
+        ::strncpy(slot->name, kind, sizeof(slot->name) - 1);
+        return slot;
+    }
+
+private:
+    TelemetrySegment *segment = nullptr;  //! Mapped segment, null if not published
+    std::string name;                     //! Name passed to shm_open()
+
+    Telemetry() {
+    }
+};
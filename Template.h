@@ -1,16 +1,30 @@
 #pragma once
 #include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <array>
+#include <memory>
+#include <tuple>
+#include <utility>
+#include <type_traits>
+#include <vector>
+#include "NumericUtils.h"
+#include "Rules.h"
 #include "Vanilla.h"
+#ifdef FIZZBUZZ_AVX2
+#include <immintrin.h>
+#endif
 
 /** The ASCII representation of any number with the indicated amount of digits */
 template <unsigned NDIG>
 struct Number {
     char data[NDIG];
-    void set(uint64_t num) {
-        for (uint32_t j = 0; j < NDIG; ++j) {
-            data[NDIG - j - 1] = num % 10 + '0';
-            num /= 10;
-        }
+    constexpr Number() : data() {
+        for (uint32_t j = 0; j < NDIG; ++j) data[j] = '0';
+    }
+    void set(uint128_t num) {
+        writedigits(data + NDIG, NDIG, num);
     }
     void increment(uint32_t num) {
         uint32_t j = 0;
@@ -23,46 +37,36 @@ struct Number {
     }
 } __attribute__((packed));
 
-/** The templated representation of one FizzBuzz block of 15 numbers */
+/** The templated representation of one FizzBuzz block of 15 numbers.
+ * All the constant terms are set at compile time so a bank of these is constant initialized,
+ * numbers start as all zeros. */
 template <unsigned NDIG>
 struct Template {
     Number<NDIG> n1;
-    char LF1;
+    char LF1 = '\n';
     Number<NDIG> n2;
-    char LF2;
-    char fizz1[5];
+    char LF2 = '\n';
+    char fizz1[5] = {'F', 'i', 'z', 'z', '\n'};
     Number<NDIG> n4;
-    char LF3;
-    char buzz1[5];
-    char fizz2[5];
+    char LF3 = '\n';
+    char buzz1[5] = {'B', 'u', 'z', 'z', '\n'};
+    char fizz2[5] = {'F', 'i', 'z', 'z', '\n'};
     Number<NDIG> n7;
-    char LF4;
+    char LF4 = '\n';
     Number<NDIG> n8;
-    char LF5;
-    char fizz3[5];
-    char buzz2[5];
+    char LF5 = '\n';
+    char fizz3[5] = {'F', 'i', 'z', 'z', '\n'};
+    char buzz2[5] = {'B', 'u', 'z', 'z', '\n'};
     Number<NDIG> n11;
-    char LF6;
-    char fizz4[5];
+    char LF6 = '\n';
+    char fizz4[5] = {'F', 'i', 'z', 'z', '\n'};
     Number<NDIG> n13;
-    char LF7;
+    char LF7 = '\n';
     Number<NDIG> n14;
-    char LF8;
-    char fizzbuzz[9];
-
-    /** Initializes all the constant terms of this block minus the actual numbers */
-    Template() {
-        LF1 = LF2 = LF3 = LF4 = LF5 = LF6 = LF7 = LF8 = '\n';
-        std::memcpy(fizz1, "Fizz\n", 5);
-        std::memcpy(fizz2, "Fizz\n", 5);
-        std::memcpy(fizz3, "Fizz\n", 5);
-        std::memcpy(fizz4, "Fizz\n", 5);
-        std::memcpy(buzz1, "Buzz\n", 5);
-        std::memcpy(buzz2, "Buzz\n", 5);
-        std::memcpy(fizzbuzz, "FizzBuzz\n", 9);
-        reset(ipow10(NDIG));
-    }
-    void reset(uint64_t base) {
+    char LF8 = '\n';
+    char fizzbuzz[9] = {'F', 'i', 'z', 'z', 'B', 'u', 'z', 'z', '\n'};
+
+    void reset(uint128_t base) {
         n1.set(base);
         n2.set(base + 1);
         n4.set(base + 3);
@@ -84,115 +88,337 @@ struct Template {
     }
 
     // Fills the block starting with the number base
-    uint32_t fill(uint64_t base, char *ptr) {
+    uint32_t fill(uint128_t base, char *ptr) {
+        static_assert(sizeof(*this) == blockSize(NDIG), "Block layout does not match its size");
         reset(base);
-        if (sizeof(*this) != calcBlockSize(base)) {
-            fprintf(stderr, "Error base %ld expected %ld got %d\n", base, sizeof(*this), calcBlockSize(base));
-        }
-        std::memcpy(ptr, (void *)this, sizeof(*this));
-        return sizeof(*this);
+        std::memcpy(ptr, (void *)this, blockSize(NDIG));
+        return blockSize(NDIG);
     }
 
     // Fills the block incrementing the BCD number only
     uint32_t incfill(uint32_t delta, char *ptr) {
         increment(delta);
-        std::memcpy(ptr, (void *)this, sizeof(*this));
-        return sizeof(*this);
+        std::memcpy(ptr, (void *)this, blockSize(NDIG));
+        return blockSize(NDIG);
     }
 } __attribute__((packed));
 
+#ifdef FIZZBUZZ_AVX2
+/** Reverses the 32 bytes of a YMM register */
+static inline __m256i reverse(__m256i x) {
+    const __m256i rev = _mm256_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,  //
+                                         15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    return _mm256_permute4x64_epi64(_mm256_shuffle_epi8(x, rev), 0x4E);
+}
+
+/** Moves every byte one position up, towards the higher digits of the reversed text */
+static inline __m256i shiftup(__m256i x) {
+    return _mm256_alignr_epi8(x, _mm256_permute2x128_si256(x, x, 0x08), 15);
+}
+
+/** Adds delta digits (already aligned to the units of each number) to a window of byte-reversed
+ * ASCII text, so the carries travel towards the higher bytes. Bytes outside digitmask are left untouched.
+ * Every pass turns the digits above '9' into a carry for the next digit, so a block costs a single
+ * pass unless a carry lands on a nine, which happens once every few blocks. */
+static inline __m256i addDigits(__m256i text, __m256i delta, __m256i digitmask) {
+    const __m256i nine = _mm256_set1_epi8('9');
+    const __m256i ten = _mm256_set1_epi8(10);
+    __m256i sum = _mm256_add_epi8(text, delta);
+    __m256i carry = _mm256_and_si256(_mm256_cmpgt_epi8(sum, nine), digitmask);
+    while (!_mm256_testz_si256(carry, carry)) {
+        // Adding the carry is subtracting -1
+        sum = _mm256_sub_epi8(sum, _mm256_and_si256(carry, ten));
+        sum = _mm256_sub_epi8(sum, _mm256_and_si256(shiftup(carry), digitmask));
+        carry = _mm256_and_si256(_mm256_cmpgt_epi8(sum, nine), digitmask);
+    }
+    return sum;
+}
+
+/** The AVX2 flavor of a block template. The block is kept as 8 overlapping 32-byte windows,
+ * one starting at each number (or ending at the block end, whichever comes first) so all the
+ * numbers are incremented at once in YMM registers and the block is written with 8 stores.
+ * Windows are stored in ascending order: bytes of a number cut at the end of a window are stale
+ * but always rewritten by the window of that number, which comes later.
+ * Windows are kept byte-reversed, which is what the carry trick in addDigits needs. */
+template <unsigned NDIG>
+struct AVXTemplate {
+    using Text = Template<NDIG>;
+    static const uint32_t size = blockSize(NDIG);
+
+    alignas(32) char windows[8][32];     //! Current text of the block seen through each window (reversed)
+    alignas(32) char digitmasks[8][32];  //! Bytes of each window holding a number up to its units
+    alignas(32) char deltas[8][32];      //! Increment digits aligned to the units of each number
+    uint32_t starts[8];                  //! Offset of each window in the block
+    uint32_t numbers[8];                 //! Offset of each number in the block
+    uint32_t lastdelta;                  //! The increment the deltas were computed for
+    Text text;                           //! Scalar block, used only to seed the windows
+
+    constexpr AVXTemplate()
+        : windows(),
+          digitmasks(),
+          deltas(),
+          starts(),
+          numbers{offsetof(Text, n1), offsetof(Text, n2),  offsetof(Text, n4),  offsetof(Text, n7),
+                  offsetof(Text, n8), offsetof(Text, n11), offsetof(Text, n13), offsetof(Text, n14)},
+          lastdelta(0),
+          text() {
+        for (uint32_t w = 0; w < 8; ++w) {
+            starts[w] = numbers[w] < size - 32 ? numbers[w] : size - 32;
+            for (uint32_t pos : numbers) {
+                if ((pos + NDIG <= starts[w]) || (pos + NDIG > starts[w] + 32)) continue;
+                for (uint32_t j = pos; j < pos + NDIG; ++j) {
+                    if (j >= starts[w]) digitmasks[w][starts[w] + 31 - j] = char(0xFF);
+                }
+            }
+        }
+    }
+
+    /** Spreads the digits of an increment under the units of every number in each window */
+    void prepare(uint32_t delta) {
+        lastdelta = delta;
+        std::memset(deltas, 0, sizeof(deltas));
+        for (uint32_t w = 0; w < 8; ++w) {
+            for (uint32_t pos : numbers) {
+                uint32_t units = pos + NDIG - 1;
+                if ((units < starts[w]) || (units >= starts[w] + 32)) continue;
+                uint32_t value = delta;
+                for (uint32_t j = units; (value > 0) && (j >= starts[w]) && (j >= pos); --j) {
+                    deltas[w][starts[w] + 31 - j] = value % 10;
+                    value /= 10;
+                }
+            }
+        }
+    }
+
+    // Fills the block starting with the number base
+    uint32_t fill(uint128_t base, char *ptr) {
+        text.fill(base, ptr);
+        const char *p = (const char *)&text;
+        for (uint32_t w = 0; w < 8; ++w) {
+            __m256i window = reverse(_mm256_loadu_si256((const __m256i *)(p + starts[w])));
+            _mm256_store_si256((__m256i *)windows[w], window);
+        }
+        return size;
+    }
+
+    // Fills the block incrementing all the numbers at once, one 32-byte store per window
+    uint32_t incfill(uint32_t delta, char *ptr) {
+        if (delta != lastdelta) prepare(delta);
+        for (uint32_t w = 0; w < 8; ++w) {
+            __m256i window = addDigits(_mm256_load_si256((const __m256i *)windows[w]),
+                                       _mm256_load_si256((const __m256i *)deltas[w]),
+                                       _mm256_load_si256((const __m256i *)digitmasks[w]));
+            _mm256_store_si256((__m256i *)windows[w], window);
+            _mm256_storeu_si256((__m256i *)(ptr + starts[w]), reverse(window));
+        }
+        return size;
+    }
+};
+
+/** Past this width the windows would not cover the words between numbers anymore */
+const unsigned AVXMAXDIGITS = 21;
+
+template <unsigned NDIG>
+using BankTemplate = typename std::conditional<(NDIG <= AVXMAXDIGITS), AVXTemplate<NDIG>, Template<NDIG>>::type;
+#else
+template <unsigned NDIG>
+using BankTemplate = Template<NDIG>;
+#endif
+
+/** Largest digit width with its own template, every 128 bit number has one */
+const uint32_t MAXTEMPLATEDIGITS = MAXWIDEDIGITS;
+
+/** Holds one template per digit width, index 0 has the 1-digit one */
+template <typename Seq>
+struct TemplateTuple;
+template <size_t... N>
+struct TemplateTuple<std::index_sequence<N...>> {
+    using type = std::tuple<BankTemplate<N + 1>...>;
+};
+
 /** Represents all possible templates with all numbers of digits.
- * Basically this was meant to encapsulate the huge switches  below */
+ * The whole bank, constant words included, is built at compile time so a TemplateBank is
+ * constant initialized and the per-width dispatch is a lookup in the tables below. */
 struct TemplateBank {
-    Template<1> t1;
-    Template<2> t2;
-    Template<3> t3;
-    Template<4> t4;
-    Template<5> t5;
-    Template<6> t6;
-    Template<7> t7;
-    Template<8> t8;
-    Template<9> t9;
-    Template<10> t10;
-    Template<11> t11;
-    Template<12> t12;
-    Template<13> t13;
-    Template<14> t14;
-    Template<15> t15;
-    Template<16> t16;
-    Template<17> t17;
-    Template<18> t18;
-    Template<19> t19;
-    Template<20> t20;
-
-    uint64_t base;       // Base used in last operation
-    uint32_t ndigits;    // Number of digits last operation
-    uint64_t nextpow10;  // Next power of 10 from last operation
+    typename TemplateTuple<std::make_index_sequence<MAXTEMPLATEDIGITS>>::type templates;
 
-    /** Fill the respective template and returns the length of the ascii representation */
-    uint32_t fill(uint64_t number, char *ptr) {
+    uint128_t base = 0;       // Base used in last operation
+    uint32_t ndigits = 0;     // Number of digits last operation, 0 if it was printed by vanilla()
+    uint128_t nextpow10 = 0;  // Next power of 10 from last operation
+
+    using Filler = uint32_t (*)(TemplateBank &, uint128_t, char *);
+    using IncFiller = uint32_t (*)(TemplateBank &, uint32_t, char *);
+
+    /** Per width entry points, indexed by number of digits */
+    template <size_t NDIG>
+    static uint32_t fillwidth(TemplateBank &bank, uint128_t number, char *ptr) {
+        return std::get<NDIG - 1>(bank.templates).fill(number, ptr);
+    }
+    template <size_t NDIG>
+    static uint32_t incfillwidth(TemplateBank &bank, uint32_t delta, char *ptr) {
+        return std::get<NDIG - 1>(bank.templates).incfill(delta, ptr);
+    }
+    template <size_t... N>
+    static constexpr std::array<Filler, sizeof...(N) + 1> makeFillers(std::index_sequence<N...>) {
+        return {nullptr, &fillwidth<N + 1>...};
+    }
+    template <size_t... N>
+    static constexpr std::array<IncFiller, sizeof...(N) + 1> makeIncFillers(std::index_sequence<N...>) {
+        return {nullptr, &incfillwidth<N + 1>...};
+    }
+
+    /** Repositions the bank at any number. The next incfill(0) computes that block from scratch. */
+    void seek(uint128_t number) {
         base = number;
-        std::tie(ndigits, nextpow10) = vlog10(base);
-        if (base + 15 - 1 < nextpow10) {
-            switch (ndigits) {
-                case 1: return t1.fill(base, ptr); break;
-                case 2: return t2.fill(base, ptr); break;
-                case 3: return t3.fill(base, ptr); break;
-                case 4: return t4.fill(base, ptr); break;
-                case 5: return t5.fill(base, ptr); break;
-                case 6: return t6.fill(base, ptr); break;
-                case 7: return t7.fill(base, ptr); break;
-                case 8: return t8.fill(base, ptr); break;
-                case 9: return t9.fill(base, ptr); break;
-                case 10: return t10.fill(base, ptr); break;
-                case 11: return t11.fill(base, ptr); break;
-                case 12: return t12.fill(base, ptr); break;
-                case 13: return t13.fill(base, ptr); break;
-                case 14: return t14.fill(base, ptr); break;
-                case 15: return t15.fill(base, ptr); break;
-                case 16: return t16.fill(base, ptr); break;
-                case 17: return t17.fill(base, ptr); break;
-                case 18: return t18.fill(base, ptr); break;
-                case 19: return t19.fill(base, ptr); break;
-                case 20: return t20.fill(base, ptr); break;
-            }
-        }
-        return vanilla(base, ptr);
+        ndigits = 0;
     }
 
+    /** Fill the respective template and returns the length of the ascii representation */
+    uint32_t fill(uint128_t number, char *ptr);
+
     /** Fills the respective template by adding a value.
      * A bit complex logic to keep everything in sync. */
+    uint32_t incfill(uint32_t delta, char *ptr);
+};
+
+static constexpr auto fillers = TemplateBank::makeFillers(std::make_index_sequence<MAXTEMPLATEDIGITS>());
+static constexpr auto incfillers = TemplateBank::makeIncFillers(std::make_index_sequence<MAXTEMPLATEDIGITS>());
+
+inline uint32_t TemplateBank::fill(uint128_t number, char *ptr) {
+    base = number;
+    std::tie(ndigits, nextpow10) = vlog10(base);
+    if (base + 15 - 1 < nextpow10) {
+        return fillers[ndigits](*this, base, ptr);
+    }
+    ndigits = 0;
+    return vanilla(base, ptr);
+}
+
+inline uint32_t TemplateBank::incfill(uint32_t delta, char *ptr) {
+    base += delta;
+    // Blocks only move forward, so still below the next power of 10 means still the same width
+    if ((ndigits != 0) && (base + 15 - 1 < nextpow10)) {
+        return incfillers[ndigits](*this, delta, ptr);
+    }
+    return fill(base, ptr);
+}
+
+/** Value of a digit in radixchars without a branch: '0'-'9' are 0x30-0x39 and 'a'-'f' 0x61-0x66 */
+static inline uint32_t digitvalue(char c) {
+    return (c & 0xF) + 9 * ((c >> 6) & 1);
+}
+
+/** The runtime flavor of Template for any rules. Built once per digit width from the rules layout,
+ * then every block only increments its numbers in place and is copied out whole, the same
+ * increment-only work the compile time templates do. Hex and octal carry with shifts and masks. */
+struct RuleTemplate {
+    std::vector<char> text;       //! The whole block
+    std::vector<uint32_t> units;  //! Offset of the units digit of every number field, in order
+    uint32_t ndigits;             //! Width of all the number fields
+    uint32_t radix;               //! Base the numbers are printed in
+    uint32_t bits;                //! Bits per digit when the radix is a power of two, 0 for decimal
+
+    RuleTemplate(const Rules &rules, uint32_t ndig)
+        : text(rules.blockSize(ndig)),
+          ndigits(ndig),
+          radix(rules.format.radix),
+          bits(radix == 10 ? 0 : __builtin_ctz(radix)) {
+        char *p = text.data();
+        for (uint32_t k = 0; k <= rules.numbers.size(); ++k) {
+            const std::string &literal(rules.literals[k]);
+            std::memcpy(p, literal.data(), literal.size());
+            p += literal.size();
+            if (k == rules.numbers.size()) break;
+            std::memset(p, '0', ndigits);
+            units.push_back(p + ndigits - 1 - text.data());
+            p += ndigits;
+        }
+    }
+
+    // Fills the block starting with the number base
+    uint32_t fill(const Rules &rules, uint128_t base, char *ptr) {
+        for (uint32_t k = 0; k < units.size(); ++k) {
+            writedigits(&text[units[k]] + 1, ndigits, base + rules.numbers[k], radix);
+        }
+        std::memcpy(ptr, text.data(), text.size());
+        return text.size();
+    }
+
+    // Fills the block incrementing the numbers only
     uint32_t incfill(uint32_t delta, char *ptr) {
-        base += delta;
-        uint32_t ndig = digits(base);
-        if (ndig == digits(base + 15 - 1)) {
-            if (ndig != ndigits) {
-                ndigits = ndig;
-                return fill(base, ptr);
+        char *data = text.data();
+        if (bits == 0) {
+            for (uint32_t pos : units) {
+                uint32_t num = delta;
+                for (char *d = data + pos; num > 0; --d) {
+                    num += *d - '0';
+                    *d = (num % 10) + '0';
+                    num /= 10;
+                }
             }
-            switch (ndig) {
-                case 1: return t1.incfill(delta, ptr); break;
-                case 2: return t2.incfill(delta, ptr); break;
-                case 3: return t3.incfill(delta, ptr); break;
-                case 4: return t4.incfill(delta, ptr); break;
-                case 5: return t5.incfill(delta, ptr); break;
-                case 6: return t6.incfill(delta, ptr); break;
-                case 7: return t7.incfill(delta, ptr); break;
-                case 8: return t8.incfill(delta, ptr); break;
-                case 9: return t9.incfill(delta, ptr); break;
-                case 10: return t10.incfill(delta, ptr); break;
-                case 11: return t11.incfill(delta, ptr); break;
-                case 12: return t12.incfill(delta, ptr); break;
-                case 13: return t13.incfill(delta, ptr); break;
-                case 14: return t14.incfill(delta, ptr); break;
-                case 15: return t15.incfill(delta, ptr); break;
-                case 16: return t16.incfill(delta, ptr); break;
-                case 17: return t17.incfill(delta, ptr); break;
-                case 18: return t18.incfill(delta, ptr); break;
-                case 19: return t19.incfill(delta, ptr); break;
-                case 20: return t20.incfill(delta, ptr); break;
+        } else {
+            const uint32_t mask = radix - 1;
+            for (uint32_t pos : units) {
+                uint32_t num = delta;
+                for (char *d = data + pos; num > 0; --d) {
+                    num += digitvalue(*d);
+                    *d = radixchars[num & mask];
+                    num >>= bits;
+                }
             }
         }
-        return vanilla(base, ptr);
+        std::memcpy(ptr, data, text.size());
+        return text.size();
+    }
+};
+
+/** Same as TemplateBank for rules other than the standard ones. Templates are built the first time
+ * their width shows up, a period can be long and most runs only see a few widths. */
+struct RuleBank {
+    const Rules &rules;                                    //! Layout of every block
+    std::vector<std::unique_ptr<RuleTemplate>> templates;  //! Indexed by field width, null until used
+    uint128_t base = 0;                                    //! Base used in last operation
+    uint32_t ndigits = 0;                                  //! Number of digits last operation
+
+    RuleBank(const Rules &r) : rules(r), templates(r.format.maxWidth() + 1) {
+    }
+
+    /** Repositions the bank at any number. The next incfill(0) computes that block from scratch. */
+    void seek(uint128_t number) {
+        base = number;
+        ndigits = 0;
+    }
+
+    /** Width of the number fields of the block starting at number, 0 if they do not all have the same.
+     * Fixed width fields never change. */
+    uint32_t width(uint128_t number) const {
+        if (rules.format.width > 0) return rules.format.width;
+        uint32_t ndig = rules.numDigits(number);
+        return ndig == rules.numDigits(number + rules.period - 1) ? ndig : 0;
+    }
+
+    /** Fill the respective template and returns the length of the ascii representation */
+    uint32_t fill(uint128_t number, char *ptr) {
+        base = number;
+        uint32_t ndig = width(base);
+        if (ndig != 0) {
+            if (!templates[ndig]) templates[ndig].reset(new RuleTemplate(rules, ndig));
+            ndigits = ndig;
+            return templates[ndig]->fill(rules, base, ptr);
+        }
+        ndigits = 0;
+        return vanilla(rules, base, ptr);
+    }
+
+    /** Fills the respective template by adding a value */
+    uint32_t incfill(uint32_t delta, char *ptr) {
+        base += delta;
+        uint32_t ndig = width(base);
+        if (ndig != 0) {
+            if (ndig != ndigits) return fill(base, ptr);
+            return templates[ndig]->incfill(delta, ptr);
+        }
+        ndigits = 0;
+        return vanilla(rules, base, ptr);
     }
 };
@@ -0,0 +1,209 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <cerrno>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+/** Expands a sysfs cpu list like "0-3,8,10-11" */
+static std::vector<uint32_t> parsecpulist(const std::string &text) {
+    std::vector<uint32_t> cpus;
+    std::stringstream ss(text);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (item.empty()) continue;
+        char *end;
+        uint32_t lo = std::strtoul(item.c_str(), &end, 10);
+        uint32_t hi = *end == '-' ? std::strtoul(end + 1, nullptr, 10) : lo;
+        for (uint32_t cpu = lo; cpu <= hi; ++cpu) cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+/** Reads the first token of a sysfs file, empty if it does not exist */
+static std::string readsys(const std::string &path) {
+    std::ifstream inp(path);
+    std::string value;
+    inp >> value;
+    return value;
+}
+
+/** Pins the calling thread to one cpu. Returns false, reported on stderr, if it could not. */
+static bool pincpu(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (::sched_setaffinity(0, sizeof(set), &set) < 0) {
+        int err = errno;
+        std::cerr << "Could not pin to cpu " << cpu << ": " << strerror(err) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/** Binds a page aligned range to a NUMA node before it is first touched. Done with the raw
+ * syscall so there is no libnuma dependency. Failures are harmless, first touch still applies. */
+static bool bindnode(void *ptr, size_t size, int node) {
+    if ((node < 0) || (size == 0)) return false;
+    unsigned long mask[4] = {0, 0, 0, 0};
+    if (node >= int(8 * sizeof(mask))) return false;
+    mask[node / (8 * sizeof(long))] |= 1UL << (node % (8 * sizeof(long)));
+    return ::syscall(__NR_mbind, ptr, size, MPOL_PREFERRED, mask, 8 * sizeof(mask), 0) == 0;
+}
+
+/**
+ * CPU layout read from /sys/devices/system/cpu, the same way getL2CacheSize() gets the cache size,
+ * restricted to the cpus this process is allowed to run on. Places the writer and generator
+ * threads of every pipeline following a policy:
+ *  - "cache": generators as close as possible to their writer: same L2, then L3, then node
+ *  - "spread": generators spread over as many nodes, L3s and L2s as possible
+ *  - "0,2,4": explicit cpus, writer first, generators cycling through the rest
+ * Cpus already handed out to other pipelines are only reused once every cpu has a thread.
+ */
+class Topology {
+public:
+    /** One logical cpu. Caches are identified by the first cpu that shares them. */
+    struct Cpu {
+        uint32_t id;       //! Logical cpu number
+        int32_t node;      //! NUMA node, 0 if the kernel has no NUMA support
+        uint32_t package;  //! Physical socket
+        uint32_t l2;       //! Identifies the L2 cache
+        uint32_t l3;       //! Identifies the L3 cache, the package if there is none
+    };
+
+    static Topology &instance() {
+        static Topology topology;
+        return topology;
+    }
+
+    /** Node of a logical cpu, -1 if not known */
+    int node(int cpu) const {
+        for (const Cpu &c : cpulist) {
+            if (int(c.id) == cpu) return c.node;
+        }
+        return -1;
+    }
+
+    /** Returns true if policy is one we know how to place */
+    static bool valid(const std::string &policy) {
+        return policy.empty() || (policy == "none") || (policy == "cache") || (policy == "spread") ||
+               (policy.find_first_not_of("0123456789,-") == std::string::npos);
+    }
+
+    /** Chooses the cpus of one pipeline: the writer's first (if it has one), then one per generator.
+     * Returns an empty list when not pinning. */
+    std::vector<int> place(const std::string &policy, uint32_t numthreads, bool haswriter) {
+        std::vector<int> placed;
+        if (policy.empty() || (policy == "none") || cpulist.empty()) return placed;
+        uint32_t count = numthreads + (haswriter ? 1 : 0);
+        if (policy.find_first_not_of("0123456789,-") == std::string::npos) {
+            std::vector<uint32_t> list = parsecpulist(policy);
+            if (list.empty()) return placed;
+            std::vector<uint32_t> rest(list.size() > 1 ? list.begin() + 1 : list.begin(), list.end());
+            if (haswriter) placed.push_back(list[0]);
+            for (uint32_t j = 0; j < numthreads; ++j) placed.push_back(rest[j % rest.size()]);
+            return placed;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        bool spread = policy == "spread";
+        // The first thread (the writer, or the first generator) goes to the least used cpu
+        std::vector<uint32_t> mine(cpulist.size(), 0);
+        uint32_t first = 0;
+        for (uint32_t k = 1; k < cpulist.size(); ++k) {
+            if (load[k] < load[first]) first = k;
+        }
+        std::vector<uint32_t> chosen{first};
+        mine[first]++;
+        for (uint32_t j = 1; j < count; ++j) {
+            uint32_t best = 0;
+            uint64_t bestkey = UINT64_MAX;
+            for (uint32_t k = 0; k < cpulist.size(); ++k) {
+                uint64_t distance = spread ? sharing(k, chosen) : proximity(cpulist[first], cpulist[k]);
+                uint64_t key = (uint64_t(load[k] + mine[k]) << 48) | (distance << 16) | k;
+                if (key < bestkey) {
+                    bestkey = key;
+                    best = k;
+                }
+            }
+            chosen.push_back(best);
+            mine[best]++;
+        }
+        for (uint32_t k : chosen) {
+            load[k]++;
+            placed.push_back(cpulist[k].id);
+        }
+        return placed;
+    }
+
+private:
+    std::vector<Cpu> cpulist;    //! Cpus we are allowed to run on
+    std::vector<uint32_t> load;  //! Threads placed on every cpu so far, by all the pipelines
+    std::mutex mutex;            //! Pipelines of different shards place concurrently
+
+    Topology() {
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        bool restricted = ::sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+        std::string base = "/sys/devices/system/cpu/";
+        for (uint32_t id : parsecpulist(readsys(base + "online"))) {
+            if (restricted && !CPU_ISSET(id, &allowed)) continue;
+            std::string dir = base + "cpu" + std::to_string(id) + "/";
+            Cpu cpu{id, 0, 0, id, id};
+            cpu.package = std::strtoul(readsys(dir + "topology/physical_package_id").c_str(), nullptr, 10);
+            cpu.l3 = 1000000 + cpu.package;
+            for (uint32_t index = 0;; ++index) {
+                std::string cache = dir + "cache/index" + std::to_string(index) + "/";
+                std::string level = readsys(cache + "level");
+                if (level.empty()) break;
+                std::vector<uint32_t> shared = parsecpulist(readsys(cache + "shared_cpu_list"));
+                if (shared.empty()) continue;
+                if (level == "2") cpu.l2 = shared[0];
+                if (level == "3") cpu.l3 = shared[0];
+            }
+            if (DIR *d = ::opendir(dir.c_str())) {
+                while (dirent *ent = ::readdir(d)) {
+                    if ((::strncmp(ent->d_name, "node", 4) == 0) && ::isdigit(ent->d_name[4])) {
+                        cpu.node = std::atoi(ent->d_name + 4);
+                    }
+                }
+                ::closedir(d);
+            }
+            cpulist.push_back(cpu);
+        }
+        load.resize(cpulist.size(), 0);
+    }
+
+    /** 0 for the same cpu, then same L2, L3, package, node and anything else */
+    static uint64_t proximity(const Cpu &a, const Cpu &b) {
+        if (a.id == b.id) return 0;
+        if (a.l2 == b.l2) return 1;
+        if (a.l3 == b.l3) return 2;
+        if (a.package == b.package) return 3;
+        if (a.node == b.node) return 4;
+        return 5;
+    }
+
+    /** How crowded the node, L3 and L2 of cpu k already are with the threads chosen so far */
+    uint64_t sharing(uint32_t k, const std::vector<uint32_t> &chosen) const {
+        uint64_t nodes = 0, l3s = 0, l2s = 0;
+        for (uint32_t c : chosen) {
+            nodes += cpulist[c].node == cpulist[k].node;
+            l3s += cpulist[c].l3 == cpulist[k].l3;
+            l2s += cpulist[c].l2 == cpulist[k].l2;
+        }
+        return (nodes << 20) | (l3s << 10) | l2s;
+    }
+};
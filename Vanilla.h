@@ -1,24 +1,55 @@
 
 #pragma once
 #include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include "Rules.h"
 
-static uint32_t vanilla(uint64_t base, char *p) {
-    char *start = p;
-    p += sprintf(p, "%ld\n", base);
-    p += sprintf(p, "%ld\n", base + 1);
+/** Prints a number followed by a newline, no null */
+static uint32_t printline(char *ptr, uint128_t num) {
+    uint32_t len = printnumber(ptr, num);
+    ptr[len] = '\n';
+    return len + 1;
+}
+
+/** Prints a 15-number block into ptr. Rendered aside first since sprintf ends with a null, which
+ * would land on the first byte of the next block, possibly another thread's. printf has no 128 bit
+ * conversion so the numbers go through printnumber(). */
+static uint32_t vanilla(uint128_t base, char *ptr) {
+    char text[512];
+    char *start = text;
+    char *p = text;
+    p += printline(p, base);
+    p += printline(p, base + 1);
     p += sprintf(p, "Fizz\n");
-    p += sprintf(p, "%ld\n", base + 3);
+    p += printline(p, base + 3);
     p += sprintf(p, "Buzz\n");
     p += sprintf(p, "Fizz\n");
-    p += sprintf(p, "%ld\n", base + 6);
-    p += sprintf(p, "%ld\n", base + 7);
+    p += printline(p, base + 6);
+    p += printline(p, base + 7);
     p += sprintf(p, "Fizz\n");
     p += sprintf(p, "Buzz\n");
-    p += sprintf(p, "%ld\n", base + 10);
+    p += printline(p, base + 10);
     p += sprintf(p, "Fizz\n");
-    p += sprintf(p, "%ld\n", base + 12);
-    p += sprintf(p, "%ld\n", base + 13);
+    p += printline(p, base + 12);
+    p += printline(p, base + 13);
     p += sprintf(p, "FizzBuzz\n");
     uint32_t numchars = p - start;
+    std::memcpy(ptr, text, numchars);
     return numchars;
 }
+
+/** Prints one block of any rules starting at base, where base is a multiple of the period plus one.
+ * Handles the blocks where the numbers change width, which the templates cannot. */
+static uint32_t vanilla(const Rules &rules, uint128_t base, char *ptr) {
+    char *p = ptr;
+    for (uint32_t k = 0; k < rules.numbers.size(); ++k) {
+        const std::string &literal(rules.literals[k]);
+        std::memcpy(p, literal.data(), literal.size());
+        p += literal.size();
+        p += printnumber(p, base + rules.numbers[k], rules.format.width, rules.format.radix);
+    }
+    const std::string &literal(rules.literals.back());
+    std::memcpy(p, literal.data(), literal.size());
+    return p + literal.size() - ptr;
+}
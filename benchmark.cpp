@@ -0,0 +1,285 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "MemUtils.h"
+
+/** One binary with its command line */
+struct Case {
+    std::string name;               //! Unique key in the results and the baseline
+    std::string binary;             //! Executable name in the binary directory
+    std::vector<std::string> args;  //! Command line arguments
+    uint32_t threads;               //! Generator threads, 0 if the binary has no such option
+    uint32_t blocks;                //! Blocks per chunk, 0 if the binary has no such option
+};
+
+/** What one run measured */
+struct Result {
+    bool ok = false;      //! Produced output and exited cleanly
+    uint64_t bytes = 0;   //! Bytes drained from the pipe
+    double seconds = 0;   //! From the first byte to the last one
+    double gbps = 0;      //! bytes / seconds, in GB/s
+    double cpu = 0;       //! User plus system seconds of the binary, all its threads
+    double ttfb = 0;      //! Seconds from exec() to the first byte
+};
+
+/** Drain limits for every run */
+struct Limits {
+    double seconds = 1;                                     //! Stop draining after this long
+    uint64_t bytes = std::numeric_limits<uint64_t>::max();  //! Or after this many bytes
+};
+
+static double elapsed(std::chrono::steady_clock::time_point since) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - since).count();
+}
+
+/** Runs the binary with its stdout into a pipe that is drained into /dev/null with splice(),
+ * so the sink never touches the bytes. Closes the pipe once a limit is hit and reaps the binary. */
+static Result run(const std::string &dir, const Case &cs, const Limits &limits) {
+    Result res;
+    int fds[2];
+    if (::pipe(fds) < 0) {
+        perror("pipe");
+        return res;
+    }
+    ::fcntl(fds[0], F_SETPIPE_SZ, getmaxpipe());
+    std::string path = dir + "/" + cs.binary;
+    auto start = std::chrono::steady_clock::now();
+    pid_t pid = ::fork();
+    if (pid == 0) {
+        ::dup2(fds[1], STDOUT_FILENO);
+        int devnull = ::open("/dev/null", O_WRONLY);
+        ::dup2(devnull, STDERR_FILENO);
+        ::close(fds[0]);
+        ::close(fds[1]);
+        std::vector<char *> argv;
+        argv.push_back((char *)path.c_str());
+        for (const std::string &arg : cs.args) argv.push_back((char *)arg.c_str());
+        argv.push_back(nullptr);
+        ::execv(path.c_str(), argv.data());
+        ::_exit(127);
+    }
+    ::close(fds[1]);
+    if (pid < 0) {
+        perror("fork");
+        ::close(fds[0]);
+        return res;
+    }
+
+    int devnull = ::open("/dev/null", O_WRONLY);
+    std::chrono::steady_clock::time_point first;
+    while (res.bytes < limits.bytes) {
+        double left = limits.seconds - (res.bytes > 0 ? elapsed(first) : elapsed(start));
+        if (left <= 0) break;
+        pollfd pfd{fds[0], POLLIN, 0};
+        if (::poll(&pfd, 1, int(left * 1000) + 1) <= 0) continue;
+        uint64_t want = std::min<uint64_t>(limits.bytes - res.bytes, 1 << 20);
+        ssize_t nb = ::splice(fds[0], nullptr, devnull, nullptr, want, SPLICE_F_MOVE);
+        if (nb <= 0) {
+            if ((nb < 0) && (errno == EINTR)) continue;
+            break;
+        }
+        if (res.bytes == 0) {
+            first = std::chrono::steady_clock::now();
+            res.ttfb = std::chrono::duration<double>(first - start).count();
+        }
+        res.bytes += nb;
+    }
+    if (res.bytes > 0) res.seconds = elapsed(first);
+    ::close(devnull);
+    ::close(fds[0]);
+
+    // A closed pipe stops every binary, the kill is only for the ones that hang
+    int status = 0;
+    rusage usage;
+    bool killed = false;
+    auto closed = std::chrono::steady_clock::now();
+    while (::wait4(pid, &status, WNOHANG, &usage) == 0) {
+        if (!killed && (elapsed(closed) > 2)) {
+            ::kill(pid, SIGKILL);
+            killed = true;
+        }
+        waitms(1);
+    }
+    res.cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1E6 + usage.ru_stime.tv_sec +
+              usage.ru_stime.tv_usec / 1E6;
+    bool clean = WIFEXITED(status) ? WEXITSTATUS(status) == 0
+                                   : (WTERMSIG(status) == SIGPIPE) || (killed && (WTERMSIG(status) == SIGKILL));
+    res.ok = (res.bytes > 0) && clean;
+    res.gbps = res.seconds > 0 ? res.bytes / res.seconds / 1E9 : 0;
+    return res;
+}
+
+/** Splits "1,2,4" */
+static std::vector<uint32_t> parselist(const char *text) {
+    std::vector<uint32_t> values;
+    std::stringstream ss(text);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (!item.empty()) values.push_back(std::strtoul(item.c_str(), nullptr, 10));
+    }
+    return values;
+}
+
+/** Returns the value of "key": in a line of our own JSON output */
+static std::string field(const std::string &line, const std::string &key) {
+    std::string tag = "\"" + key + "\": ";
+    size_t pos = line.find(tag);
+    if (pos == std::string::npos) return std::string();
+    pos += tag.size();
+    if (line[pos] == '"') return line.substr(pos + 1, line.find('"', pos + 1) - pos - 1);
+    return line.substr(pos, line.find_first_of(",}", pos) - pos);
+}
+
+/** Writes one result per line so the baseline can be read back without a JSON library */
+static bool writejson(const std::string &filename, const std::vector<Case> &cases, const std::vector<Result> &results) {
+    std::ofstream out(filename);
+    if (!out) {
+        fprintf(stderr, "Could not write %s\n", filename.c_str());
+        return false;
+    }
+    out << "{\n  \"results\": [\n";
+    for (size_t j = 0; j < cases.size(); ++j) {
+        const Case &cs(cases[j]);
+        const Result &res(results[j]);
+        char line[512];
+        ::snprintf(line, sizeof(line),
+                   "    {\"name\": \"%s\", \"binary\": \"%s\", \"threads\": %u, \"blocks\": %u, \"ok\": %s, "
+                   "\"bytes\": %lu, \"seconds\": %.6f, \"gbps\": %.6f, \"cpu\": %.6f, \"ttfb\": %.6f}%s\n",
+                   cs.name.c_str(), cs.binary.c_str(), cs.threads, cs.blocks, res.ok ? "true" : "false", res.bytes,
+                   res.seconds, res.gbps, res.cpu, res.ttfb, j + 1 < cases.size() ? "," : "");
+        out << line;
+    }
+    out << "  ]\n}\n";
+    return true;
+}
+
+/** Reads name -> GB/s back from a file written by writejson, failed runs are left out */
+static std::map<std::string, double> readjson(const std::string &filename) {
+    std::map<std::string, double> baseline;
+    std::ifstream inp(filename);
+    std::string line;
+    while (std::getline(inp, line)) {
+        std::string name = field(line, "name");
+        if (name.empty() || (field(line, "ok") != "true")) continue;
+        baseline[name] = std::strtod(field(line, "gbps").c_str(), nullptr);
+    }
+    return baseline;
+}
+
+int main(int argc, char *argv[]) {
+    std::string dir;
+    std::string jsonfile = "benchmark.json";
+    std::string basefile;
+    std::vector<uint32_t> threads{1, 2};
+    std::vector<uint32_t> blocks{50, 200};
+    Limits limits;
+    double tolerance = 0.25;
+    for (int j = 1; j < argc; ++j) {
+        if ((::strcmp(argv[j], "--dir") == 0) && (j + 1 < argc)) {
+            dir = argv[++j];
+        } else if ((::strcmp(argv[j], "--json") == 0) && (j + 1 < argc)) {
+            jsonfile = argv[++j];
+        } else if ((::strcmp(argv[j], "--baseline") == 0) && (j + 1 < argc)) {
+            basefile = argv[++j];
+        } else if ((::strcmp(argv[j], "--threads") == 0) && (j + 1 < argc)) {
+            threads = parselist(argv[++j]);
+        } else if ((::strcmp(argv[j], "--blocks") == 0) && (j + 1 < argc)) {
+            blocks = parselist(argv[++j]);
+        } else if ((::strcmp(argv[j], "--seconds") == 0) && (j + 1 < argc)) {
+            limits.seconds = std::strtod(argv[++j], nullptr);
+        } else if ((::strcmp(argv[j], "--bytes") == 0) && (j + 1 < argc)) {
+            limits.bytes = std::strtoull(argv[++j], nullptr, 10);
+        } else if ((::strcmp(argv[j], "--tolerance") == 0) && (j + 1 < argc)) {
+            tolerance = std::strtod(argv[++j], nullptr);
+        } else {
+            printf(
+                "Usage: benchmark [--dir bindir] [--threads 1,2] [--blocks 50,200] [--seconds S] [--bytes K]\n"
+                "                 [--json results.json] [--baseline baseline.json] [--tolerance 0.25]\n");
+            return 0;
+        }
+    }
+    // The binaries are built next to this one by default
+    if (dir.empty()) {
+        char self[4096];
+        ssize_t len = ::readlink("/proc/self/exe", self, sizeof(self) - 1);
+        self[len > 0 ? len : 0] = '\0';
+        char *slash = ::strrchr(self, '/');
+        dir = slash != nullptr ? std::string(self, slash - self) : ".";
+    }
+
+    std::vector<Case> cases;
+    for (uint32_t nt : threads) {
+        for (uint32_t nb : blocks) {
+            std::string ntext = std::to_string(nt);
+            std::string btext = std::to_string(nb);
+            cases.push_back({"fizzbuzz/" + ntext + "/" + btext, "fizzbuzz", {ntext, btext}, nt, nb});
+        }
+        cases.push_back({"fbthread/" + std::to_string(nt), "fbthread", {std::to_string(nt)}, nt, 0});
+        cases.push_back({"fbinterleaved/" + std::to_string(nt), "fbinterleaved", {std::to_string(nt)}, nt, 0});
+    }
+    cases.push_back({"fizzbuzz.avx2", "fizzbuzz.avx2", {}, 0, 0});
+    cases.push_back({"fizzbuzz.vanilla", "fizzbuzz.vanilla", {}, 0, 0});
+
+    // Runs missing from this build are dropped instead of being reported as failures
+    std::vector<Case> present;
+    for (const Case &cs : cases) {
+        if (::access((dir + "/" + cs.binary).c_str(), X_OK) == 0) present.push_back(cs);
+    }
+    cases.swap(present);
+
+    std::map<std::string, double> baseline;
+    if (!basefile.empty()) {
+        if (::access(basefile.c_str(), R_OK) == 0) {
+            baseline = readjson(basefile);
+        } else {
+            printf("No baseline at %s, nothing to compare against\n", basefile.c_str());
+        }
+    }
+
+    printf("%-22s %3s %9s %8s %8s %9s %9s %8s\n", "Name", "Ok", "Bytes", "GB/s", "CPU s", "TTFB ms", "Base GB/s",
+           "Change");
+    std::vector<Result> results;
+    uint32_t regressions = 0;
+    for (const Case &cs : cases) {
+        Result res = run(dir, cs, limits);
+        results.push_back(res);
+        char base[16] = "-";
+        char change[16] = "-";
+        auto it = baseline.find(cs.name);
+        if ((it != baseline.end()) && (it->second > 0)) {
+            double ratio = res.gbps / it->second;
+            ::snprintf(base, sizeof(base), "%.3f", it->second);
+            ::snprintf(change, sizeof(change), "%+.1f%%", (ratio - 1) * 100);
+            if (!res.ok || (ratio < 1 - tolerance)) {
+                ::strcat(change, " !");
+                regressions++;
+            }
+        }
+        printf("%-22s %3s %8.1fM %8.3f %8.3f %9.2f %9s %8s\n", cs.name.c_str(), res.ok ? "yes" : "NO", res.bytes / 1E6,
+               res.gbps, res.cpu, res.ttfb * 1000, base, change);
+        fflush(stdout);
+    }
+
+    if (!writejson(jsonfile, cases, results)) return 1;
+    printf("Results written to %s\n", jsonfile.c_str());
+    if (regressions > 0) {
+        printf("%u runs are more than %.0f%% slower than the baseline\n", regressions, tolerance * 100);
+        return 1;
+    }
+    return 0;
+}
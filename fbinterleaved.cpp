@@ -1,74 +1,126 @@
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <memory>
 #include <vector>
 #include <atomic>
 #include <iostream>
-#include <cassert>
 #include <thread>
-#include <immintrin.h>
+#include <sys/ioctl.h>
 #include "MemUtils.h"
 #include "NumericUtils.h"
 #include "LapTimer.h"
-#include "Vanilla.h"
+#include "SpinLock.h"
 #include "Template.h"
 
-using Flag = std::atomic<uint32_t>;
-
 const uint32_t MAXBLOCKSIZE = 300;  // max 15-number block size with 20 digits 64 bit integers
+const uint32_t CACHELINE = 64;      // partitions start on their own cache line
 
-using Flag = std::atomic<uint32_t>;
-struct Work {
-    Flag flag;
-    uint32_t idx;
-    uint32_t nthreads;
-    char **buffer_ptr;
-    uint32_t bufsize;
-    std::thread thread;
+/** The cycle being rendered, set by the main thread before every release */
+struct Engine {
+    uint32_t nthreads;                             //! Workers sharing every cycle
+    char *buffer;                                  //! The single shared buffer
+    uint64_t base;                                 //! First number of the cycle
+    uint64_t nbytes;                               //! Size of the cycle in bytes
+    alignas(64) std::atomic<uint64_t> epoch{0};    //! Cycles released to the workers so far
+    alignas(64) std::atomic<uint32_t> pending{0};  //! Workers that did not finish the cycle yet
+    alignas(64) std::atomic<bool> stop{false};     //! Raised when the main thread gives up
 };
 
-void generator(Work &work) {
-    TemplateBank bank;
-    uint64_t base = 1;
-    uint32_t accumulated = 0;
-    char *buffer = *work.buffer_ptr;
-    bank.fill(1, buffer);
-    while (true) {
-        // Wait for release
-        // fprintf(stderr, "\tThread %d waiting...\n", work.idx);
-        while (work.flag.load() == 0) __builtin_ia32_pause();
-        // fprintf(stderr, "\tThread %d released...\n", work.idx);
-        uint32_t nbytes = 0;
-        char *ptr = buffer;
-        uint32_t numdigits = 1;
-        while (ptr - buffer < work.bufsize - MAXBLOCKSIZE) {
-            if ((base - 1) / 15 % work.nthreads == work.idx) {
-                // generate block
-                ptr += bank.incfill(accumulated, ptr);
-                accumulated = 0;
+/** Returns the first number of the cycle after the one starting at base.
+ * A cycle holds all the blocks that start before the buffer limit. */
+uint64_t nextcycle(uint64_t base, uint32_t bufsize) {
+    uint64_t last = offsetLine(lineOffset(base) + bufsize - MAXBLOCKSIZE - 1);
+    return ((last - 1) / 15) * 15 + 1 + 15;
+}
 
-            } else {
-                // skip block
-                ptr += calcBlockSize(base);
+/** Byte offset in the cycle where the partition of thread idx starts, on a cache line boundary */
+uint64_t partition(uint64_t nbytes, uint32_t idx, uint32_t nthreads) {
+    if (idx >= nthreads) return nbytes;
+    uint64_t pos = (nbytes * idx / nthreads) / CACHELINE * CACHELINE;
+    return pos < nbytes ? pos : nbytes;
+}
+
+/** Every worker renders a contiguous, cache line aligned slice of the cycle, so no two threads
+ * ever write to the same line. Blocks that fit are rendered in place. The blocks cut by the slice
+ * edges are rendered aside and only their bytes inside the slice are copied. */
+void generator(Engine &engine, uint32_t idx) {
+    TemplateBank bank;
+    char scratch[512];
+    for (uint64_t epoch = 0;; ++epoch) {
+        // Wait for the cycle to be released
+        Backoff backoff;
+        while (engine.epoch.load(std::memory_order_acquire) <= epoch) {
+            if (engine.stop.load(std::memory_order_relaxed)) return;
+            backoff.pause();
+        }
+        uint64_t lo = partition(engine.nbytes, idx, engine.nthreads);
+        uint64_t hi = partition(engine.nbytes, idx + 1, engine.nthreads);
+        if (lo < hi) {
+            // Only the first block of the slice needs an offset lookup, then sizes add up
+            uint64_t start = lineOffset(engine.base);
+            uint64_t line = offsetLine(start + lo);
+            uint64_t block = ((line - 1) / 15) * 15 + 1;
+            uint64_t pos = lineOffset(block) - start;
+            bank.seek(block);
+            uint32_t delta = 0;
+            while (pos < hi) {
+                if ((pos >= lo) && (pos + MAXBLOCKSIZE <= hi)) {
+                    pos += bank.incfill(delta, engine.buffer + pos);
+                } else {
+                    uint32_t size = bank.incfill(delta, scratch);
+                    uint64_t from = pos < lo ? lo : pos;
+                    uint64_t to = pos + size < hi ? pos + size : hi;
+                    if (from < to) std::memcpy(engine.buffer + from, scratch + (from - pos), to - from);
+                    pos += size;
+                }
+                delta = 15;
             }
-            accumulated += 15;
-            base += 15;
         }
         // Notify
-        work.flag.store(0);
-        // fprintf(stderr, "\tThread %d done\n", work.idx);
+        engine.pending.fetch_sub(1, std::memory_order_release);
+    }
+}
+
+/** Sends a whole cycle. Returns false if the output went away. */
+bool send(int fd, bool haspipe, const char *data, uint64_t size) {
+    uint64_t sentbytes = 0;
+    while (sentbytes < size) {
+        ssize_t res;
+        if (haspipe) {
+            iovec iov;
+            iov.iov_base = (void *)&data[sentbytes];
+            iov.iov_len = size - sentbytes;
+            res = ::vmsplice(fd, &iov, 1, 0);
+        } else {
+            res = ::write(fd, &data[sentbytes], size - sentbytes);
+        }
+        if (res > 0) {
+            sentbytes += res;
+        } else if ((res < 0) && (errno != EINTR) && (errno != EAGAIN)) {
+            if (errno != EPIPE) fprintf(stderr, "%s: %s\n", haspipe ? "vmsplice" : "write", strerror(errno));
+            return false;
+        }
     }
+    return true;
 }
 
 int main(int argc, char *argv[]) {
     if (argc < 2) {
-        fprintf(stdout, "Usage: fbthread <numthreads> \n");
+        fprintf(stdout, "Usage: fbinterleaved <numthreads> \n");
         return 0;
     }
+    Engine engine;
+    engine.nthreads = ::atoi(argv[1]);
+    if (engine.nthreads == 0) {
+        fprintf(stderr, "Needs at least one thread\n");
+        return 1;
+    }
+
     // Allocate buffer
-    uint32_t bufsize = getL2CacheSize() / 2;
-    char *buffer = (char *)vmalloc(bufsize);
-    int res = madvise(buffer, bufsize, MADV_HUGEPAGE);
+    uint32_t bufsize = roundtopages(getL2CacheSize() / 2);
+    engine.buffer = (char *)vmalloc(bufsize);
+    int res = madvise(engine.buffer, bufsize, MADV_HUGEPAGE);
     if (res < 0) {
         int res = errno;
         std::cerr << "madvise error: " << strerror(res) << std::endl;
@@ -77,64 +129,50 @@ int main(int argc, char *argv[]) {
     // Adjust pipe size accordingly
     int32_t maxpipe = getmaxpipe();
     uint32_t desiredsize = bufsize < maxpipe ? bufsize : maxpipe;
-    uint32_t fd = fileno(stdout);
+    int fd = fileno(stdout);
     bool haspipe = ::fcntl(fd, F_SETPIPE_SZ, desiredsize) >= 0;
-    int32_t pipesize = ::fcntl(fd, F_GETPIPE_SZ);
 
-    // Create threads
-    uint32_t numthreads = ::atoi(argv[1]);
-    std::vector<Work> workers(numthreads);
-    for (uint32_t j = 0; j < numthreads; ++j) {
-        Work &work(workers[j]);
-        work.bufsize = bufsize;
-        work.flag.store(0);
-        work.nthreads = numthreads;
-        work.idx = j;
-        work.thread = std::thread(&generator, std::ref(work));
-        work.buffer_ptr = &buffer;
+    // Create threads, all the shared state is set before they start
+    std::vector<std::thread> workers;
+    for (uint32_t j = 0; j < engine.nthreads; ++j) {
+        workers.emplace_back(&generator, std::ref(engine), j);
     }
 
-    // Start loop
+    LapTimer timer{"Main", {"send", "wait"}, 5 * tickspersec()};
     uint64_t base = 1;
-    while (true) {
-        // Release threads
-        // fprintf(stderr, "Main thread releasing threads...\n");
-        for (uint32_t j = 0; j < numthreads; ++j) {
-            workers[j].flag.store(1);
+    uint64_t total = 0;
+    bool ok = true;
+    while (ok) {
+        timer.lap(0);
+        // vmsplice() only maps the pages into the pipe, the reader has to consume them first
+        Backoff backoff;
+        int unread = 0;
+        while (haspipe && (total > 0) && (::ioctl(fd, FIONREAD, &unread) == 0) && (unread > 0)) {
+            if (pipeclosed(fd)) break;
+            backoff.pause();
         }
+        if (haspipe && (unread > 0)) break;
 
-        // Loop generating buffer
-        uint32_t nbytestosend = 0;
-        while (nbytestosend < bufsize - MAXBLOCKSIZE) {
-            nbytestosend += calcBlockSize(base);
-            base += 15;
-        }
+        // Release threads
+        uint64_t next = nextcycle(base, bufsize);
+        engine.base = base;
+        engine.nbytes = rangeBytes(base, next - 1);
+        engine.pending.store(engine.nthreads, std::memory_order_relaxed);
+        engine.epoch.fetch_add(1, std::memory_order_release);
+        base = next;
 
         // Wait for all threads to finish
-        // fprintf(stderr, "Main thread waiting...\n");
-        for (uint32_t j = 0; j < numthreads; ++j) {
-            while (workers[j].flag.load() > 0) __builtin_ia32_pause();
-        }
-        // fprintf(stderr, "Main thread sending...\n");
+        backoff = Backoff();
+        while (engine.pending.load(std::memory_order_acquire) > 0) backoff.pause();
+        timer.lap(1);
 
         // Send buffer
-        if (haspipe > 0) {
-            iovec iov;
-            uint32_t sentbytes = 0;
-            while (sentbytes < nbytestosend) {
-                iov.iov_base = &buffer[sentbytes];
-                iov.iov_len = nbytestosend - sentbytes;
-                ssize_t res = ::vmsplice(fd, &iov, 1, 0);
-                if (res > 0) {
-                    sentbytes += res;
-                } else {
-                    fprintf(stderr, "vmsplice: %s\n", strerror(errno));
-                    return 1;
-                }
-            }
-        } else {
-            ssize_t res = ::write(fd, buffer, nbytestosend);
-        }
+        ok = send(fd, haspipe, engine.buffer, engine.nbytes);
+        total += engine.nbytes;
     }
+
+    engine.stop.store(true, std::memory_order_relaxed);
+    for (std::thread &th : workers) th.join();
+    vmfree(engine.buffer, bufsize);
     return 0;
 }
@@ -0,0 +1,165 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "Telemetry.h"
+
+/** Counters of one slot at one point in time */
+struct Sample {
+    uint64_t ticks[TelemetrySlot::NUMSTEPS];
+    uint64_t laps;
+    uint64_t bytes;
+};
+
+/** Name of the most recently created fizzbuzz segment in /dev/shm, empty if there is none */
+static std::string newest() {
+    std::string best;
+    time_t besttime = 0;
+    DIR *dir = ::opendir("/dev/shm");
+    if (dir == nullptr) return best;
+    while (dirent *ent = ::readdir(dir)) {
+        if (::strncmp(ent->d_name, "fizzbuzz.", 9) != 0) continue;
+        struct stat st;
+        std::string path = std::string("/dev/shm/") + ent->d_name;
+        if ((::stat(path.c_str(), &st) == 0) && (best.empty() || (st.st_mtime >= besttime))) {
+            best = std::string("/") + ent->d_name;
+            besttime = st.st_mtime;
+        }
+    }
+    ::closedir(dir);
+    return best;
+}
+
+static Sample sample(const TelemetrySlot &slot) {
+    Sample s;
+    for (uint32_t k = 0; k < TelemetrySlot::NUMSTEPS; ++k) s.ticks[k] = slot.ticks[k].load(std::memory_order_relaxed);
+    s.laps = slot.laps.load(std::memory_order_relaxed);
+    s.bytes = slot.bytes.load(std::memory_order_relaxed);
+    return s;
+}
+
+int main(int argc, char *argv[]) {
+    std::string name;
+    double interval = 1;
+    uint64_t count = 0;
+    for (int j = 1; j < argc; ++j) {
+        if ((::strcmp(argv[j], "--interval") == 0) && (j + 1 < argc)) {
+            interval = std::strtod(argv[++j], nullptr);
+        } else if ((::strcmp(argv[j], "--count") == 0) && (j + 1 < argc)) {
+            count = std::strtoull(argv[++j], nullptr, 10);
+        } else if ((argv[j][0] != '-') && name.empty()) {
+            name = argv[j];
+        } else {
+            printf(
+                "Usage: fbstat [pid|name] [--interval seconds] [--count N]\n"
+                "Shows the live counters of a running fizzbuzz, the newest one by default.\n");
+            return 0;
+        }
+    }
+    if (name.empty()) {
+        name = newest();
+        if (name.empty()) {
+            fprintf(stderr, "No fizzbuzz running with telemetry, nothing in /dev/shm/fizzbuzz.*\n");
+            return 1;
+        }
+    } else if (name.find_first_not_of("0123456789") == std::string::npos) {
+        name = "/fizzbuzz." + name;
+    } else if (name[0] != '/') {
+        name = "/" + name;
+    }
+
+    int fd = ::shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Could not open %s: %s\n", name.c_str(), strerror(errno));
+        return 1;
+    }
+    struct stat st;
+    if ((::fstat(fd, &st) < 0) || (uint64_t(st.st_size) < sizeof(TelemetrySegment))) {
+        fprintf(stderr, "%s is not a telemetry segment\n", name.c_str());
+        return 1;
+    }
+    void *ptr = ::mmap(nullptr, sizeof(TelemetrySegment), PROT_READ, MAP_SHARED, fd, 0);
+    if (ptr == MAP_FAILED) {
+        fprintf(stderr, "Could not map %s: %s\n", name.c_str(), strerror(errno));
+        return 1;
+    }
+    const TelemetrySegment &seg(*(const TelemetrySegment *)ptr);
+    if (__atomic_load_n(&seg.magic, __ATOMIC_ACQUIRE) != TelemetrySegment::MAGIC) {
+        fprintf(stderr, "%s is not a telemetry segment\n", name.c_str());
+        return 1;
+    }
+    printf("Attached to %s pid:%d TSC:%.3f GHz\n", name.c_str(), seg.pid, seg.tickspersec / 1E9);
+
+    // Rates are computed against this first snapshot, slots that show up later start from zero
+    std::vector<Sample> previous(TelemetrySegment::MAXSLOTS);
+    uint32_t known = seg.numslots.load(std::memory_order_relaxed);
+    if (known > TelemetrySegment::MAXSLOTS) known = TelemetrySegment::MAXSLOTS;
+    for (uint32_t j = 0; j < known; ++j) previous[j] = sample(seg.slots[j]);
+    auto last = std::chrono::steady_clock::now();
+    for (uint64_t iter = 0; (count == 0) || (iter < count); ++iter) {
+        std::this_thread::sleep_for(std::chrono::duration<double>(interval));
+        // The segment is unlinked at exit, a killed process can leave it behind
+        bool gone = ((::fstat(fd, &st) == 0) && (st.st_nlink == 0)) ||
+                    ((::kill(seg.pid, 0) < 0) && (errno == ESRCH));
+
+        auto nowtime = std::chrono::steady_clock::now();
+        double seconds = std::chrono::duration<double>(nowtime - last).count();
+        last = nowtime;
+        double window = seconds * seg.tickspersec;
+        uint32_t numslots = seg.numslots.load(std::memory_order_relaxed);
+        if (numslots > TelemetrySegment::MAXSLOTS) numslots = TelemetrySegment::MAXSLOTS;
+
+        uint64_t bytes = 0;
+        uint64_t delta = 0;
+        uint64_t number = 0;
+        std::vector<std::string> lines;
+        for (uint32_t j = 0; j < numslots; ++j) {
+            const TelemetrySlot &slot(seg.slots[j]);
+            Sample cur = sample(slot);
+            Sample &prev(previous[j]);
+            bytes += cur.bytes;
+            delta += cur.bytes - prev.bytes;
+            uint64_t num = slot.number.load(std::memory_order_relaxed);
+            if (num > number) number = num;
+
+            char line[256];
+            int len = ::snprintf(line, sizeof(line), "  %-2u %-10.10s", j, slot.name);
+            for (uint32_t k = 0; k < TelemetrySlot::NUMSTEPS; ++k) {
+                double busy = (cur.ticks[k] - prev.ticks[k]) / window * 100;
+                len += ::snprintf(line + len, sizeof(line) - len, " %-5.5s %5.1f%%", slot.steps[k], busy);
+            }
+            double laps = (cur.laps - prev.laps) / seconds;
+            len += ::snprintf(line + len, sizeof(line) - len, " laps/s:%9.0f", laps);
+            uint64_t pipesize = slot.pipesize.load(std::memory_order_relaxed);
+            if (pipesize > 0) {
+                ::snprintf(line + len, sizeof(line) - len, " pipe:%luK/%luK",
+                           slot.unread.load(std::memory_order_relaxed) / 1024, pipesize / 1024);
+            }
+            lines.push_back(line);
+            prev = cur;
+        }
+
+        printf("Up:%.1fs Number:%lu Written:%.3f GB Rate:%.3f GB/s\n", (now() * 1000000 - seg.startns) / 1E9,
+               number, bytes / 1E9, delta / seconds / 1E9);
+        for (const std::string &line : lines) printf("%s\n", line.c_str());
+        fflush(stdout);
+        if (gone) {
+            printf("Process %d is gone\n", seg.pid);
+            break;
+        }
+    }
+    ::munmap(ptr, sizeof(TelemetrySegment));
+    ::close(fd);
+    return 0;
+}
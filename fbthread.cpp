@@ -4,140 +4,175 @@
 #include <vector>
 #include <atomic>
 #include <iostream>
-#include <cassert>
 #include <thread>
-#include <immintrin.h>
+#include <sys/ioctl.h>
 #include "MemUtils.h"
 #include "NumericUtils.h"
 #include "LapTimer.h"
+#include "SpinLock.h"
 #include "Template.h"
-#include "Vanilla.h"
-
-template <unsigned NDIG>
-void print(char *&p, uint64_t value) {
-    char *s = p + NDIG - 1;
-    for (uint32_t j = 0; j < NDIG; ++j) {
-        *s-- = '0' + (value % 10);
-        value /= 10;
-    }
-    p += NDIG;
-    *p++ = '\n';
-}
-
-using Flag = std::atomic<uint32_t>;
 
 const uint32_t MAXBLOCKSIZE = 300;  // max 15-number block size with 20 digits 64 bit integers
 
-using Flag = std::atomic<uint32_t>;
-struct Work {
-    Flag flag;
-    uint32_t idx;
-    uint32_t nthreads;
-    char **buffer_ptr;
-    uint32_t bufsize;
-    std::thread thread;
+/** One buffer of the ring with the cycle it currently holds */
+struct Cycle {
+    char *buffer;                                  //! One contiguous region for the whole cycle
+    uint64_t base;                                 //! First number of the cycle
+    uint64_t next;                                 //! First number of the following cycle
+    uint64_t end = 0;                              //! Bytes sent up to the end of the cycle, 0 if never sent
+    alignas(64) std::atomic<uint32_t> pending{0};  //! Workers that did not finish their blocks yet
 };
 
-void generator(Work &work) {
+/** State shared by the main thread and the workers */
+struct Engine {
+    uint32_t nthreads;                           //! Workers filling every cycle
+    uint32_t numbuffers;                         //! Cycles in the ring
+    std::unique_ptr<Cycle[]> cycles;             //! The ring, cycle k lives in cycles[k % numbuffers]
+    alignas(64) std::atomic<uint64_t> epoch{0};  //! Cycles released to the workers so far
+    alignas(64) std::atomic<bool> stop{false};   //! Raised when the main thread gives up
+};
+
+/** Returns the first number of the cycle after the one starting at base.
+ * A cycle holds all the blocks that start before the buffer limit. */
+uint64_t nextcycle(uint64_t base, uint32_t bufsize) {
+    uint64_t last = offsetLine(lineOffset(base) + bufsize - MAXBLOCKSIZE - 1);
+    return ((last - 1) / 15) * 15 + 1 + 15;
+}
+
+/** Every worker fills every cycle, taking one block out of nthreads. Blocks are dealt globally
+ * so the stride stays the same across cycles and the bank only ever increments. */
+void generator(Engine &engine, uint32_t idx) {
     TemplateBank bank;
-    uint64_t base = 1;
-    while (true) {
-        // Wait for release
-        // fprintf(stderr, "\tThread %d waiting...\n", work.idx);
-        while (work.flag.load() == 0) __builtin_ia32_pause();
-        // fprintf(stderr, "\tThread %d released...\n", work.idx);
-        uint32_t nbytes = 0;
-        char *buffer = *work.buffer_ptr;
-        char *ptr = buffer;
-        while (ptr - buffer < work.bufsize - MAXBLOCKSIZE) {
-            if ((base - 1) / 15 % work.nthreads == work.idx) {
-                ptr += bank.fill(base, ptr);
-            } else {
-                // skip block
-                ptr += calcBlockSize(base);
+    uint32_t stride = 15 * engine.nthreads;
+    bool first = true;
+    for (uint64_t epoch = 0;; ++epoch) {
+        // Wait for the cycle to be released
+        Backoff backoff;
+        while (engine.epoch.load(std::memory_order_acquire) <= epoch) {
+            if (engine.stop.load(std::memory_order_relaxed)) return;
+            backoff.pause();
+        }
+        Cycle &cycle(engine.cycles[epoch % engine.numbuffers]);
+        uint64_t start = lineOffset(cycle.base);
+        // Jump straight to the blocks owned by this thread
+        uint64_t skip = (idx + engine.nthreads - (cycle.base - 1) / 15 % engine.nthreads) % engine.nthreads;
+        for (uint64_t block = cycle.base + 15 * skip; block < cycle.next; block += stride) {
+            if (first) {
+                bank.seek(block);
+                first = false;
             }
-            base += 15;
+            bank.incfill(block - bank.base, cycle.buffer + (lineOffset(block) - start));
         }
         // Notify
-        work.flag.store(0);
-        // fprintf(stderr, "\tThread %d done\n", work.idx);
+        cycle.pending.fetch_sub(1, std::memory_order_release);
     }
 }
+
+/** Sends a whole cycle. Returns false if the output went away. */
+bool send(int fd, bool haspipe, const char *data, uint64_t size) {
+    uint64_t sentbytes = 0;
+    while (sentbytes < size) {
+        ssize_t res;
+        if (haspipe) {
+            iovec iov;
+            iov.iov_base = (void *)&data[sentbytes];
+            iov.iov_len = size - sentbytes;
+            res = ::vmsplice(fd, &iov, 1, 0);
+        } else {
+            res = ::write(fd, &data[sentbytes], size - sentbytes);
+        }
+        if (res > 0) {
+            sentbytes += res;
+        } else if ((res < 0) && (errno != EINTR) && (errno != EAGAIN)) {
+            if (errno != EPIPE) fprintf(stderr, "%s: %s\n", haspipe ? "vmsplice" : "write", strerror(errno));
+            return false;
+        }
+    }
+    return true;
+}
+
 int main(int argc, char *argv[]) {
     if (argc < 2) {
-        fprintf(stdout, "Usage: fbthread <numthreads> \n");
+        fprintf(stdout, "Usage: fbthread <numthreads> [numbuffers]\n");
         return 0;
     }
-    // Allocate buffer
-    uint32_t bufsize = getL2CacheSize() / 2;
-    char *buffer = (char *)vmalloc(bufsize);
-    int res = madvise(buffer, bufsize, MADV_HUGEPAGE);
+    Engine engine;
+    engine.nthreads = ::atoi(argv[1]);
+    engine.numbuffers = argc > 2 ? ::atoi(argv[2]) : 2;
+    if ((engine.nthreads == 0) || (engine.numbuffers < 2)) {
+        fprintf(stderr, "Needs at least one thread and two buffers\n");
+        return 1;
+    }
+
+    // Allocate the buffers, one contiguous region each
+    uint32_t bufsize = roundtopages(getL2CacheSize() / 2);
+    size_t totalsize = size_t(bufsize) * engine.numbuffers;
+    char *buffer = (char *)vmalloc(totalsize);
+    int res = madvise(buffer, totalsize, MADV_HUGEPAGE);
     if (res < 0) {
         int res = errno;
         std::cerr << "madvise error: " << strerror(res) << std::endl;
     }
+    engine.cycles.reset(new Cycle[engine.numbuffers]);
+    for (uint32_t j = 0; j < engine.numbuffers; ++j) engine.cycles[j].buffer = &buffer[size_t(j) * bufsize];
 
     // Adjust pipe size accordingly
     int32_t maxpipe = getmaxpipe();
     uint32_t desiredsize = bufsize < maxpipe ? bufsize : maxpipe;
-    uint32_t fd = fileno(stdout);
+    int fd = fileno(stdout);
     bool haspipe = ::fcntl(fd, F_SETPIPE_SZ, desiredsize) >= 0;
-    int32_t pipesize = ::fcntl(fd, F_GETPIPE_SZ);
 
     // Create threads
-    uint32_t numthreads = ::atoi(argv[1]);
-    std::vector<Work> workers(numthreads);
-    for (uint32_t j = 0; j < numthreads; ++j) {
-        Work &work(workers[j]);
-        work.bufsize = bufsize;
-        work.flag.store(0);
-        work.nthreads = numthreads;
-        work.idx = j;
-        work.thread = std::thread(&generator, std::ref(work));
-        work.buffer_ptr = &buffer;
+    std::vector<std::thread> workers;
+    for (uint32_t j = 0; j < engine.nthreads; ++j) {
+        workers.emplace_back(&generator, std::ref(engine), j);
     }
 
-    // Start loop
+    // The workers fill the next cycles while this one is being sent. vmsplice() only maps the
+    // pages into the pipe, so a buffer is only released again once the reader consumed it.
+    LapTimer timer{"Main", {"send", "wait"}, 5 * tickspersec()};
     uint64_t base = 1;
-    while (true) {
-        // Release threads
-        // fprintf(stderr, "Main thread releasing threads...\n");
-        for (uint32_t j = 0; j < numthreads; ++j) {
-            workers[j].flag.store(1);
-        }
-
-        // Loop generating buffer
-        uint32_t nbytestosend = 0;
-        while (nbytestosend < bufsize - MAXBLOCKSIZE) {
-            nbytestosend += calcBlockSize(base);
-            base += 15;
-        }
-
-        // Wait for all threads to finish
-        // fprintf(stderr, "Main thread waiting...\n");
-        for (uint32_t j = 0; j < numthreads; ++j) {
-            while (workers[j].flag.load() > 0) __builtin_ia32_pause();
+    uint64_t released = 0;
+    uint64_t sent = 0;
+    uint64_t total = 0;
+    bool ok = true;
+    while (ok) {
+        timer.lap(0);
+        Backoff backoff;
+        while (true) {
+            int unread = 0;
+            if (haspipe && (::ioctl(fd, FIONREAD, &unread) < 0)) unread = 0;
+            while (released < sent + engine.numbuffers) {
+                Cycle &cycle(engine.cycles[released % engine.numbuffers]);
+                if ((cycle.end != 0) && haspipe && (cycle.end + unread > total)) break;
+                cycle.base = base;
+                cycle.next = nextcycle(base, bufsize);
+                base = cycle.next;
+                cycle.pending.store(engine.nthreads, std::memory_order_relaxed);
+                engine.epoch.store(++released, std::memory_order_release);
+            }
+            Cycle &cycle(engine.cycles[sent % engine.numbuffers]);
+            if ((released > sent) && (cycle.pending.load(std::memory_order_acquire) == 0)) break;
+            if ((released == sent) && pipeclosed(fd)) {
+                ok = false;
+                break;
+            }
+            backoff.pause();
         }
-        // fprintf(stderr, "Main thread sending...\n");
+        timer.lap(1);
+        if (!ok) break;
 
         // Send buffer
-        if (haspipe > 0) {
-            iovec iov;
-            uint32_t sentbytes = 0;
-            while (sentbytes < nbytestosend) {
-                iov.iov_base = &buffer[sentbytes];
-                iov.iov_len = nbytestosend - sentbytes;
-                ssize_t res = ::vmsplice(fd, &iov, 1, 0);
-                if (res > 0) {
-                    sentbytes += res;
-                } else {
-                    fprintf(stderr, "vmsplice: %s\n", strerror(errno));
-                    return 1;
-                }
-            }
-        } else {
-            ssize_t res = ::write(fd, buffer, nbytestosend);
-        }
+        Cycle &cycle(engine.cycles[sent % engine.numbuffers]);
+        uint64_t nbytes = rangeBytes(cycle.base, cycle.next - 1);
+        ok = send(fd, haspipe, cycle.buffer, nbytes);
+        total += nbytes;
+        cycle.end = total;
+        sent++;
     }
+
+    engine.stop.store(true, std::memory_order_relaxed);
+    for (std::thread &th : workers) th.join();
+    vmfree(buffer, totalsize);
     return 0;
 }
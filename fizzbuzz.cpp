@@ -1,29 +1,297 @@
 
-#include "PipeWriter.h"
-#include "Generator.h"
+#include "Pipeline.h"
 
 #include <cstdint>
 #include <cstdlib>
-#include <memory>
+#include <cstring>
+#include <csignal>
+#include <iostream>
+#include <limits>
+#include <thread>
 #include <vector>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/** Opens a shard target, either a file descriptor number or a path to create */
+static int opentarget(const char *target) {
+    char *end;
+    long fd = std::strtol(target, &end, 10);
+    if ((*end == '\0') && (end != target)) return fd;
+    int res = ::open(target, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (res < 0) {
+        int err = errno;
+        std::cerr << "Could not open " << target << ": " << strerror(err) << std::endl;
+    }
+    return res;
+}
+
+/** Creates the unix socket clients connect to, replacing a stale one left at path */
+static int listensocket(const char *path) {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (::strlen(path) >= sizeof(addr.sun_path)) {
+        std::cerr << "Socket path too long: " << path << std::endl;
+        return -1;
+    }
+    ::strcpy(addr.sun_path, path);
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    ::unlink(path);
+    if ((fd < 0) || (::bind(fd, (sockaddr *)&addr, sizeof(addr)) < 0) || (::listen(fd, SOMAXCONN) < 0)) {
+        int err = errno;
+        std::cerr << "Could not listen on " << path << ": " << strerror(err) << std::endl;
+        if (fd >= 0) ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/** Takes the telemetry segment down before dying from the signal */
+static void terminate(int sig) {
+    Telemetry::instance().unlink();
+    ::signal(sig, SIG_DFL);
+    ::raise(sig);
+}
 
 int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        printf("Usage: fizzbuzz.hb <numthreads> <numblocks> \n");
+    uint128_t from = 1;
+    uint128_t to = UINT128MAX;
+    uint64_t maxbytes = std::numeric_limits<uint64_t>::max();
+    Options opt;
+    std::vector<const char *> shards;
+    std::vector<const char *> args;
+    std::string stats = Telemetry::defaultname();
+    std::vector<Rule> list = Rules().rules;
+    Format format;
+    std::string checkpointpath;
+    uint64_t interval = 10;
+    bool resume = false;
+    std::string servepath;
+    uint64_t window = 16 << 20;
+    for (int j = 1; j < argc; ++j) {
+        if ((::strcmp(argv[j], "--from") == 0) && (j + 1 < argc)) {
+            from = strtou128(argv[++j]);
+        } else if ((::strcmp(argv[j], "--to") == 0) && (j + 1 < argc)) {
+            to = strtou128(argv[++j]);
+        } else if ((::strcmp(argv[j], "--bytes") == 0) && (j + 1 < argc)) {
+            maxbytes = std::strtoull(argv[++j], nullptr, 10);
+        } else if ((::strcmp(argv[j], "--buffers") == 0) && (j + 1 < argc)) {
+            opt.numbuffers = std::atoi(argv[++j]);
+        } else if ((::strcmp(argv[j], "--shard") == 0) && (j + 1 < argc)) {
+            shards.push_back(argv[++j]);
+        } else if ((::strcmp(argv[j], "--stats") == 0) && (j + 1 < argc)) {
+            stats = argv[++j];
+        } else if ((::strcmp(argv[j], "--pin") == 0) && (j + 1 < argc)) {
+            opt.pin = argv[++j];
+        } else if ((::strcmp(argv[j], "--checkpoint") == 0) && (j + 1 < argc)) {
+            checkpointpath = argv[++j];
+        } else if ((::strcmp(argv[j], "--interval") == 0) && (j + 1 < argc)) {
+            interval = std::strtoull(argv[++j], nullptr, 10);
+        } else if ((::strcmp(argv[j], "--serve") == 0) && (j + 1 < argc)) {
+            servepath = argv[++j];
+        } else if ((::strcmp(argv[j], "--window") == 0) && (j + 1 < argc)) {
+            window = std::strtoull(argv[++j], nullptr, 10);
+        } else if (::strcmp(argv[j], "--resume") == 0) {
+            resume = true;
+        } else if ((::strcmp(argv[j], "--rules") == 0) && (j + 1 < argc)) {
+            if (!Rules::parse(argv[++j], list)) return 1;
+        } else if ((::strcmp(argv[j], "--separator") == 0) && (j + 1 < argc)) {
+            format.separator = Format::separatorText(argv[++j]);
+        } else if ((::strcmp(argv[j], "--width") == 0) && (j + 1 < argc)) {
+            format.width = std::atoi(argv[++j]);
+        } else if ((::strcmp(argv[j], "--radix") == 0) && (j + 1 < argc)) {
+            format.radix = std::atoi(argv[++j]);
+        } else if (::strcmp(argv[j], "--numbered") == 0) {
+            format.delimiter = ":";
+        } else if (::strcmp(argv[j], "--csv") == 0) {
+            format.delimiter = ",";
+        } else if (::strcmp(argv[j], "--uring") == 0) {
+            opt.uring = true;
+        } else if (::strcmp(argv[j], "--direct") == 0) {
+            opt.direct = true;
+        } else if (::strcmp(argv[j], "--mmap") == 0) {
+            opt.mapped = true;
+        } else if (::strcmp(argv[j], "--hugepages") == 0) {
+            opt.hugepages = true;
+        } else {
+            args.push_back(argv[j]);
+        }
+    }
+    if ((args.size() != 2) || (from == 0) || (to < from) || (opt.numbuffers == 0) || (window == 0) ||
+        !Topology::valid(opt.pin)) {
+        printf(
+            "Usage: fizzbuzz.hb <numthreads> <numblocks> [--from N] [--to M] [--bytes K] [--buffers B] [--uring] "
+            "[--direct] [--mmap] [--shard fd|path]... [--stats name]\n"
+            "       [--pin cache|spread|cpu,cpu,...] [--hugepages] [--rules 3:Fizz,5:Buzz,...]\n"
+            "       [--separator lf|crlf|nul|text] [--numbered|--csv] [--width W] [--radix 8|10|16]\n"
+            "       [--checkpoint path [--interval S] [--resume]] [--serve path [--window K]]\n");
         return 0;
     }
+    if (!Rules::valid(list, format)) return 1;
+    opt.rules = Rules(list, format);
+    opt.numthreads = std::atoi(args[0]);
+    opt.numblocks = std::atoi(args[1]);
+
+    // A resumed run picks up the range where the checkpoint left it, whatever was asked for
+    const Rules &rules(opt.rules);
+    Checkpoint checkpoint;
+    uint32_t skip = 0;
+    if (resume) {
+        if (checkpointpath.empty()) {
+            std::cerr << "--resume needs --checkpoint" << std::endl;
+            return 1;
+        }
+        if (!checkpoint.load(checkpointpath)) return 1;
+        if (checkpoint.layout != rules.fingerprint()) {
+            std::cerr << "The checkpoint was taken with other --rules or format options" << std::endl;
+            return 1;
+        }
+        from = checkpoint.line;
+        skip = checkpoint.skip;
+        to = checkpoint.to;
+        maxbytes = checkpoint.remaining;
+        if ((from > to) || (maxbytes == 0)) {
+            std::cerr << "Nothing left to print after " << checkpoint.bytes << " bytes" << std::endl;
+            return 0;
+        }
+        if (skip >= rules.lineSize(from)) {
+            std::cerr << "The checkpoint skips " << skip << " bytes of a line of " << rules.lineSize(from) << std::endl;
+            return 1;
+        }
+    }
+
+    // Numbers go up to 2^128-1, as long as the last block does not wrap around
+    if (to > rules.maxLine()) to = rules.maxLine();
+    if (from > to) {
+        std::cerr << "--from is past the last number that can be printed, " << tostring(rules.maxLine()) << std::endl;
+        return 1;
+    }
+
+    // No point generating past the line that holds the last byte
+    if (maxbytes != std::numeric_limits<uint64_t>::max()) {
+        uint128_t last = maxbytes > 0 ? rules.offsetLine(from, skip + maxbytes - 1) : from;
+        if (last < to) to = last;
+    }
+    if ((format.width > 0) && (rules.numDigits(to) > format.width)) {
+        std::cerr << "--width " << format.width << " needs the range bounded by --to or --bytes below "
+                  << format.radix << "^" << format.width << std::endl;
+        return 1;
+    }
+
+    // A closed pipe is reported by write() instead
+    ::signal(SIGPIPE, SIG_IGN);
+
+    // Live counters for fbstat, an empty name turns them off
+    if (!stats.empty() && Telemetry::instance().open(stats)) {
+        ::signal(SIGINT, terminate);
+        ::signal(SIGTERM, terminate);
+    }
+
+    // Or streams to every client of a unix socket, generating only once for all of them
+    int output = fileno(stdout);
+    if (!servepath.empty()) {
+        if (!shards.empty() || !checkpointpath.empty()) {
+            std::cerr << "--serve cannot be combined with --shard or --checkpoint" << std::endl;
+            return 1;
+        }
+        output = listensocket(servepath.c_str());
+        if (output < 0) return 1;
+        opt.window = window;
+        std::cerr << "Serving on " << servepath << ", clients can lag " << window << " bytes behind" << std::endl;
+    }
 
-    uint32_t nthreads = std::atoi(argv[1]);
-    uint32_t numblocks = std::atoi(argv[2]);
-    uint32_t bufsize = numblocks * (8 * 20 + 7 * 5);
-    uint32_t jump = (nthreads - 1) * numblocks * 15;
-    uint32_t stride = numblocks * 15;
-    using GeneratorPtr = std::shared_ptr<Generator>;
-    std::vector<GeneratorPtr> loops;
-    PipeWriter writer(nthreads, bufsize);
-    for (uint32_t j = 0; j < nthreads; ++j) {
-        GeneratorPtr loop(new Generator(writer, 1 + j * stride, numblocks, jump));
-        loops.push_back(loop);
+    uint64_t faults = minorfaults();
+    if (shards.empty() && checkpointpath.empty()) {
+        bool ok = pipeline(output, from, to, maxbytes, opt);
+        std::cerr << "Minor page faults: " << minorfaults() - faults << std::endl;
+        if (!servepath.empty()) ::unlink(servepath.c_str());
+        return ok ? 0 : 1;
+    }
+
+    // Checkpoints are saved every interval seconds from their own thread, and once more at the end.
+    // SIGINT and SIGTERM are blocked everywhere and taken by that thread: it asks the writers to
+    // stop between two writes so the last checkpoint is exactly where the output stops.
+    if (!checkpointpath.empty()) {
+        if (!shards.empty()) {
+            std::cerr << "--checkpoint cannot follow several --shard outputs" << std::endl;
+            return 1;
+        }
+        checkpoint.start(from, skip, to, maxbytes, rules);
+        if (!checkpoint.save(checkpointpath, rules)) return 1;
+        opt.progress = &checkpoint.progress;
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        ::pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+        std::atomic<bool> finished{false};
+        int stopsignal = 0;
+        std::thread saver([&]() {
+            const timespec tick{0, 100000000};
+            uint64_t next = monotonicns() + interval * 1000000000ULL;
+            while (!finished.load(std::memory_order_acquire)) {
+                int sig = ::sigtimedwait(&signals, nullptr, &tick);
+                if (sig > 0) {
+                    stopsignal = sig;
+                    checkpoint.progress.stop.store(true, std::memory_order_relaxed);
+                    return;
+                }
+                if ((interval > 0) && (monotonicns() >= next)) {
+                    checkpoint.save(checkpointpath, rules);
+                    next += interval * 1000000000ULL;
+                }
+            }
+        });
+        bool ok = pipeline(fileno(stdout), from, to, maxbytes, opt, skip);
+        finished.store(true, std::memory_order_release);
+        saver.join();
+        ok = checkpoint.save(checkpointpath, rules) && ok;
+        std::cerr << "Minor page faults: " << minorfaults() - faults << std::endl;
+        if (stopsignal != 0) {
+            std::cerr << "Stopped, continue with --resume from " << checkpointpath << std::endl;
+            ::pthread_sigmask(SIG_UNBLOCK, &signals, nullptr);
+            terminate(stopsignal);
+        }
+        return ok ? 0 : 1;
+    }
+
+    // Each shard gets a contiguous run of whole lines, about the same number of bytes each,
+    // so the outputs concatenate to the full stream. Every shard has its own threads and writer.
+    if ((to == rules.maxLine()) && (maxbytes == std::numeric_limits<uint64_t>::max())) {
+        std::cerr << "--shard needs the range bounded by --to or --bytes" << std::endl;
+        return 1;
+    }
+    uint128_t range = rules.rangeBytes(from, to);
+    uint64_t total = range < maxbytes ? uint64_t(range) : maxbytes;
+    std::vector<uint128_t> lines;
+    for (uint32_t j = 0; j < shards.size(); ++j) {
+        lines.push_back(rules.offsetLine(from, uint128_t(total) * j / shards.size()));
+    }
+    lines.push_back(to + 1);
+
+    std::vector<std::thread> threads;
+    std::vector<char> results(shards.size(), 1);
+    for (uint32_t j = 0; j < shards.size(); ++j) {
+        int fd = opentarget(shards[j]);
+        if (fd < 0) {
+            results[j] = 0;
+            continue;
+        }
+        uint128_t first = lines[j];
+        uint128_t last = lines[j + 1] - 1;
+        if (last < first) continue;
+        // Only the last shard can be cut in the middle of a line
+        uint64_t nbytes = j + 1 < shards.size() ? std::numeric_limits<uint64_t>::max()
+                                                 : total - uint64_t(rules.lineOffset(first) - rules.lineOffset(from));
+        threads.emplace_back([&results, j, fd, first, last, nbytes, &opt]() {
+            results[j] = pipeline(fd, first, last, nbytes, opt);
+        });
+    }
+    for (std::thread &th : threads) th.join();
+    std::cerr << "Minor page faults: " << minorfaults() - faults << std::endl;
+    for (char ok : results) {
+        if (!ok) return 1;
     }
-    writer.run();
+    return 0;
 }
@@ -0,0 +1,47 @@
+#include "Histogram.h"
+#include <iostream>
+#include <algorithm>
+#include <random>
+#include <vector>
+
+void test(uint64_t value) {
+    uint32_t index = Histogram::bucket(value);
+    uint64_t high = Histogram::upper(index);
+    uint64_t low = index > 0 ? Histogram::upper(index - 1) + 1 : 0;
+    if ((index >= Histogram::NUMBUCKETS) || (value < low) || (value > high) || (high - low > value / 16)) {
+        std::cerr << value << " index:" << index << " low:" << low << " high:" << high << std::endl;
+    }
+}
+
+int main() {
+    for (uint64_t value = 0; value < 100000; ++value) {
+        test(value);
+    }
+    for (uint32_t j = 1; j < 64; ++j) {
+        for (int32_t k = -1; k < 2; ++k) {
+            test((1ULL << j) + k);
+        }
+    }
+    test(~0ULL);
+
+    // Percentiles of a known distribution stay within one bucket
+    Histogram h;
+    std::mt19937_64 rng(42);
+    std::vector<uint64_t> values;
+    for (uint32_t j = 0; j < 1000000; ++j) {
+        uint64_t value = rng() % 1000000;
+        values.push_back(value);
+        h.add(value);
+    }
+    std::sort(values.begin(), values.end());
+    for (double p : {0.5, 0.9, 0.99, 0.999, 1.0}) {
+        uint64_t exact = values[uint64_t(p * values.size()) - 1];
+        uint64_t approx = h.percentile(p);
+        if ((approx < exact) || (approx - exact > exact / 16)) {
+            std::cerr << "p" << p << " exact:" << exact << " histogram:" << approx << std::endl;
+        }
+    }
+    if (h.max() != values.back()) {
+        std::cerr << "max " << h.max() << " expected " << values.back() << std::endl;
+    }
+}
@@ -0,0 +1,53 @@
+#include <cstdio>
+#include <iostream>
+#include <string.h>
+#include "NumericUtils.h"
+#include "Vanilla.h"
+
+void test(uint64_t line, uint64_t offset) {
+    uint64_t calcoffset = lineOffset(line);
+    if (calcoffset != offset) {
+        fprintf(stderr, "Error line:%ld real:%ld calc:%ld\n", line, offset, calcoffset);
+    }
+    uint32_t size = lineSize(line);
+    for (uint64_t pos = offset; pos < offset + size; ++pos) {
+        uint64_t calcline = offsetLine(pos);
+        if (calcline != line) {
+            fprintf(stderr, "Error offset:%ld real:%ld calc:%ld\n", pos, line, calcline);
+        }
+    }
+}
+
+int main() {
+    // Walks the whole stream adding up the real block sizes
+    char buffer[512];
+    uint64_t offset = 0;
+    for (uint64_t base = 1; base < 100000000ULL; base += 15) {
+        uint32_t realsize = vanilla(base, buffer);
+        if (rangeBytes(base, base + 14) != realsize) {
+            fprintf(stderr, "Error base:%ld real:%d calc:%ld\n", base, realsize, rangeBytes(base, base + 14));
+        }
+        if (base < 10000000ULL) {
+            const char *p = buffer;
+            for (uint32_t j = 0; j < 15; ++j) {
+                test(base + j, offset + (p - buffer));
+                p = strchr(p, '\n') + 1;
+            }
+        } else {
+            test(base, offset);
+        }
+        offset += realsize;
+    }
+    // Checks the epoch boundaries against the block by block sum
+    for (uint32_t j = 1; j < MAXOFFSETDIGITS; ++j) {
+        uint64_t pow10 = ipow10(j);
+        for (int32_t k = -16; k < 16; ++k) {
+            if ((k < 0) && (uint64_t(-k) >= pow10)) continue;
+            uint64_t line = pow10 + k;
+            uint64_t base = ((line - 1) / 15) * 15 + 1;
+            uint64_t offset = lineOffset(base);
+            for (uint64_t n = base; n < line; ++n) offset += lineSize(n);
+            test(line, offset);
+        }
+    }
+}
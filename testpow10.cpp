@@ -12,6 +12,15 @@ void test(uint64_t num) {
     }
 }
 
+// Same for 128 bit numbers, against a division loop since printf cannot print them
+void testwide(uint128_t num) {
+    uint32_t ndigits = 1;
+    for (uint128_t n = num; n >= 10; n /= 10) ndigits++;
+    if (digits(num) != ndigits) {
+        std::cerr << tostring(num) << "," << digits(num) << "," << ndigits << std::endl;
+    }
+}
+
 int main() {
     for (uint32_t j = 0; j < 15; ++j) {
         test(1410065401 + j);
@@ -25,4 +34,17 @@ int main() {
             test(value);
         }
     }
-}
\ No newline at end of file
+    for (uint32_t j = 1; j < 128; ++j) {
+        for (int32_t k = -1; k < 2; ++k) {
+            testwide((uint128_t(1) << j) + k);
+        }
+    }
+    uint128_t pow10 = 1;
+    for (uint32_t j = 1; j < MAXWIDEDIGITS; ++j) {
+        pow10 *= 10;
+        for (int32_t k = -1; k < 2; ++k) {
+            testwide(pow10 + k);
+        }
+    }
+    testwide(UINT128MAX);
+}
@@ -3,108 +3,425 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <immintrin.h>
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "NumericUtils.h"
+#include "Rules.h"
+#include "MemUtils.h"
+#include "SPSCQueue.h"
+#include "SpinLock.h"
 
-struct State {
-    const char TYPE[15] = {'N', 'N', 'F', 'N', 'B', 'F', 'N', 'N', 'F', 'B', 'N', 'F', 'N', 'N', 'Z'};
-    uint64_t expected = 1;
-    char curtype = 'N';
-
-    uint32_t process(const char* ptr, uint32_t size) {
-        const char* pend = ptr + size;
-        const char* pstart = ptr;
-        uint64_t value = 0;
-        for (const char* p = ptr; p < pend; ++p) {
-            if (*p == '\n') {
-                switch (curtype) {
-                    case 'N':
-                        if (value != expected) {
-                            fprintf(stderr, "Error expected:%ld got:%ld\n", expected, value);
-                        }
-                        break;
-                    case 'F':
-                        if ((p - pstart != 4) && (::memcmp("Fizz", pstart, 4) != 0)) {
-                            fprintf(stderr, "Expected [Fizz] got [%.*s]\n", int(p - pstart), pstart);
-                        }
-                        break;
-                    case 'B':
-                        if ((p - pstart != 4) && (::memcmp("Buzz", pstart, 4) != 0)) {
-                            fprintf(stderr, "Expected [Buzz] got [%.*s]\n", int(p - pstart), pstart);
-                        }
-                        break;
-                    case 'Z':
-                        if ((p - pstart != 8) && (::memcmp("FizzBuzz", pstart, 8) != 0)) {
-                            fprintf(stderr, "Expected [FizzBuzz] got [%.*s]\n", int(p - pstart), pstart);
-                        }
-                        break;
-                }
-                pstart = p + 1;
-                ++expected;
-                curtype = TYPE[(expected - 1) % 15];
-                value = 0;
-            } else if (curtype == 'N') {
-                value = value * 10 + (*p - '0');
+/** Bytes read from the input in one go and checked by one thread */
+const uint32_t CHUNKSIZE = 2 * 1024 * 1024;
+/** Chunks owned by each checker thread */
+const uint32_t NUMCHUNKS = 4;
+
+/** Finds the next end of line eol in [ptr,end), 32 bytes per step */
+__attribute__((target("avx2"))) static const char *newlineAVX2(const char *ptr, const char *end, char eol) {
+    const __m256i lf = _mm256_set1_epi8(eol);
+    for (; ptr + 32 <= end; ptr += 32) {
+        __m256i text = _mm256_loadu_si256((const __m256i *)ptr);
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(text, lf));
+        if (mask != 0) return ptr + __builtin_ctz(mask);
+    }
+    return (const char *)::memchr(ptr, eol, end - ptr);
+}
+
+/** Same as newlineAVX2 for machines without it */
+static const char *newlineScalar(const char *ptr, const char *end, char eol) {
+    return (const char *)::memchr(ptr, eol, end - ptr);
+}
+
+/** Adds 15 to the decimal number in text. Returns false if it needs one more digit. */
+static bool add15(char *text, uint32_t size) {
+    char *ptr = text + size - 1;
+    uint32_t units = *ptr - '0' + 5;
+    uint32_t carry = units >= 10;
+    *ptr = '0' + units - 10 * carry;
+    if (size == 1) return carry == 0;
+    uint32_t tens = *--ptr - '0' + 1 + carry;
+    carry = tens >= 10;
+    *ptr = '0' + tens - 10 * carry;
+    if (carry == 0) return true;
+    while (ptr > text) {
+        if (*--ptr != '9') {
+            ++*ptr;
+            return true;
+        }
+        *ptr = '0';
+    }
+    return false;
+}
+
+/** Adds delta to the number in text, printed in radix with lowercase digits.
+ * Returns false if it needs one more digit. */
+static bool addvalue(char *text, uint32_t size, uint32_t delta, uint32_t radix) {
+    for (char *ptr = text + size - 1; delta > 0; --ptr) {
+        if (ptr < text) return false;
+        delta += *ptr <= '9' ? *ptr - '0' : *ptr - 'a' + 10;
+        *ptr = "0123456789abcdef"[delta % radix];
+        delta /= radix;
+    }
+    return true;
+}
+
+/** Expected text of consecutive lines, one block (a period of the rules) at a time. The block is kept
+ * in ASCII and advanced in place, independently of the generator code under test: words are matched
+ * against the divisors of every number and numbers are printed digit by digit, only the period is
+ * taken from the rules. Lines are split at the last byte of the separator. */
+struct Expected {
+    const Rules &rules;             //! What every number prints
+    uint128_t line;                 //! Current line number, also the value printed
+    uint128_t blockbase;            //! First line of the current block
+    uint32_t index;                 //! line - blockbase
+    uint32_t blocksize;             //! Bytes in the current block, separators included
+    std::vector<uint32_t> starts;   //! Where each line starts in block, plus the end
+    std::vector<uint32_t> fields;   //! Where every number printed in the block starts, then its size
+    std::vector<char> block;        //! Text of the current block, room for the widest numbers
+
+    Expected(const Rules &r, uint128_t first)
+        : rules(r),
+          line(first),
+          blockbase(((first - 1) / r.period) * r.period + 1),
+          index(first - blockbase),
+          starts(r.period + 1),
+          block(r.blockSize(r.format.maxWidth()) + 1) {
+        render();
+    }
+
+    /** Text of the current line without its last byte */
+    const char *text(uint32_t &size) const {
+        size = starts[index + 1] - starts[index] - 1;
+        return block.data() + starts[index];
+    }
+
+    /** Compares the current line, last byte included, with the size+1 bytes at data */
+    bool matches(const char *data, uint32_t size) const {
+        return (size + 1 == starts[index + 1] - starts[index]) &&
+               (::memcmp(data, block.data() + starts[index], size + 1) == 0);
+    }
+
+    void next() {
+        line++;
+        if (++index == rules.period) nextblock();
+    }
+
+    /** Moves to the next block, only valid at its first line */
+    void skipblock() {
+        line += rules.period;
+        nextblock();
+    }
+
+private:
+    /** Prints the block from scratch */
+    void render() {
+        const Format &format(rules.format);
+        char *ptr = block.data();
+        fields.clear();
+        for (uint32_t j = 0; j < rules.period; ++j) {
+            uint128_t value = blockbase + j;
+            starts[j] = ptr - block.data();
+            if (!format.delimiter.empty()) {
+                ptr = field(ptr, value);
+                ptr += ::sprintf(ptr, "%s", format.delimiter.c_str());
             }
+            char *word = ptr;
+            for (const Rule &rule : rules.rules) {
+                if (value % rule.divisor == 0) ptr += ::sprintf(ptr, "%s", rule.word.c_str());
+            }
+            if (ptr == word) {
+                ptr = field(ptr, value);
+            } else if (uint32_t(ptr - word) < format.width) {
+                ptr += ::sprintf(ptr, "%*s", int(format.width - (ptr - word)), "");
+            }
+            ::memcpy(ptr, format.separator.data(), format.separator.size());
+            ptr += format.separator.size();
         }
-        return pstart - ptr;
+        starts[rules.period] = blocksize = ptr - block.data();
+    }
+
+    /** Prints a number in the radix, zero padded to the fixed width if there is one, and remembers where.
+     * One digit at a time, printf has no 128 bit conversion. */
+    char *field(char *ptr, uint128_t value) {
+        const uint32_t radix = rules.format.radix;
+        char text[64];
+        char *end = text + sizeof(text);
+        char *digit = end;
+        do {
+            *--digit = "0123456789abcdef"[uint32_t(value % radix)];
+            value /= radix;
+        } while (value > 0);
+        while (end - digit < rules.format.width) *--digit = '0';
+        uint32_t len = end - digit;
+        ::memcpy(ptr, digit, len);
+        fields.push_back(ptr - block.data());
+        fields.push_back(len);
+        return ptr + len;
     }
-};
 
-struct Buffer {
-    uint32_t minsize = 1024;
-    uint32_t rdpos = 0;
-    uint32_t wrpos = 0;
-    uint32_t bufsize = 0;
-    char* data = nullptr;
-    Buffer(uint32_t size) : bufsize(size) {
-        data = (char*)malloc(bufsize);
-    }
-    char* readptr() const {
-        return data + rdpos;
-    }
-    char* writeptr() const {
-        return data + wrpos;
-    }
-    uint32_t avail() const {
-        return bufsize - wrpos;
-    }
-    uint32_t size() const {
-        return wrpos - rdpos;
-    }
-    void commit(uint32_t nbytes) {
-        wrpos += nbytes;
-        // pack if necessary
-        uint32_t left = bufsize - wrpos;
-        if (left < minsize) {
-            if (wrpos > rdpos) {
-                ::memmove(data, data + rdpos, wrpos - rdpos);
+    /** Adds a period to every number of the block, the words stay where they are */
+    void nextblock() {
+        blockbase += rules.period;
+        index = 0;
+        for (uint32_t k = 0; k < fields.size(); k += 2) {
+            char *text = block.data() + fields[k];
+            uint32_t size = fields[k + 1];
+            bool classic = (rules.period == 15) && (rules.format.radix == 10);
+            if (!(classic ? add15(text, size) : addvalue(text, size, rules.period, rules.format.radix))) {
+                render();
+                return;
             }
-            wrpos = wrpos - rdpos;
-            rdpos = 0;
         }
     }
-    void advance(uint32_t nbytes) {
-        rdpos += nbytes;
-        if (rdpos == wrpos) {
-            rdpos = wrpos = 0;
+};
+
+/** First wrong byte found by a checker thread */
+struct Mismatch {
+    uint64_t offset = std::numeric_limits<uint64_t>::max();  //! Byte offset in the stream
+    uint128_t line = 0;                                       //! Line expected at that point
+    char expected[32];                                        //! What the line should be
+    char got[32];                                             //! What it was, cut at 31 bytes
+};
+
+/** A piece of the stream that starts at a line boundary */
+struct Chunk {
+    char *data;     //! CHUNKSIZE bytes
+    uint32_t size;  //! Bytes to check
+    uint64_t pos;   //! Stream offset of data[0]
+};
+
+/** Checks chunks handed by the reader, each one seeded with its first line computed from its offset */
+class Checker {
+public:
+    SPSCQueue<Chunk *> ready{NUMCHUNKS + 1};  //! Filled chunks, a null pointer ends the thread
+    SPSCQueue<Chunk *> empty{NUMCHUNKS};      //! Chunks checked and handed back to the reader
+    uint64_t lines = 0;                       //! Complete lines checked
+    Mismatch mismatch;                        //! First error seen by this thread, if any
+
+    Checker(const Rules &r, uint128_t first, std::atomic<uint64_t> &bad)
+        : rules(r), eol(r.format.terminator()), from(first), badoffset(bad) {
+        for (uint32_t j = 0; j < NUMCHUNKS; ++j) {
+            Chunk *chunk = new Chunk;
+            chunk->data = (char *)vmalloc(CHUNKSIZE);
+            empty.push(chunk);
+            chunks.emplace_back(chunk);
+        }
+        newline = __builtin_cpu_supports("avx2") ? newlineAVX2 : newlineScalar;
+    }
+
+    ~Checker() {
+        for (auto &chunk : chunks) vmfree(chunk->data, CHUNKSIZE);
+    }
+
+    void run() {
+        Chunk *chunk;
+        while (true) {
+            Backoff backoff;
+            while (!ready.pop(chunk)) backoff.pause();
+            if (chunk == nullptr) break;
+            if (mismatch.offset == std::numeric_limits<uint64_t>::max()) check(*chunk);
+            empty.push(chunk);
+        }
+    }
+
+private:
+    const Rules &rules;                                      //! What the stream should print
+    char eol;                                                //! Last byte of every line
+    uint128_t from;                                          //! First line of the stream
+    std::atomic<uint64_t> &badoffset;                        //! Earliest mismatch of all threads
+    std::vector<std::unique_ptr<Chunk>> chunks;              //! Owned chunks
+    const char *(*newline)(const char *, const char *, char);//! AVX2 or scalar newline search
+
+    /** Records the first differing byte between the line at data and what was expected */
+    void fail(const Chunk &chunk, const char *data, uint32_t size, const Expected &expect) {
+        uint32_t explen;
+        const char *exptext = expect.text(explen);
+        uint32_t j = 0;
+        while ((j < size) && (j <= explen) && (data[j] == exptext[j])) j++;
+        mismatch.offset = chunk.pos + (data - chunk.data) + j;
+        mismatch.line = expect.line;
+        ::snprintf(mismatch.expected, sizeof(mismatch.expected), "%.*s", int(explen), exptext);
+        uint32_t gotlen = 0;
+        while ((gotlen < size) && (gotlen < sizeof(mismatch.got) - 1) && (data[gotlen] != eol)) gotlen++;
+        ::snprintf(mismatch.got, sizeof(mismatch.got), "%.*s", int(gotlen), data);
+        uint64_t prev = badoffset.load();
+        while ((mismatch.offset < prev) && !badoffset.compare_exchange_weak(prev, mismatch.offset)) {
+        }
+    }
+
+    /** Whole blocks are compared at once. Lines are only split at newlines where a block is cut by
+     * the chunk, or to find the exact mismatch. */
+    void check(const Chunk &chunk) {
+        uint128_t line = rules.offsetLine(from, chunk.pos);
+        Expected expect(rules, line);
+        const char *ptr = chunk.data;
+        const char *end = chunk.data + chunk.size;
+        if (rules.lineOffset(line) - rules.lineOffset(from) != chunk.pos) {
+            // Some earlier chunk is wrong too and it will have the earlier offset
+            fail(chunk, ptr, chunk.size, expect);
+            return;
+        }
+        while (ptr < end) {
+            if ((expect.index == 0) && (uint64_t(end - ptr) >= expect.blocksize) &&
+                (::memcmp(ptr, expect.block.data(), expect.blocksize) == 0)) {
+                ptr += expect.blocksize;
+                expect.skipblock();
+                lines += rules.period;
+                continue;
+            }
+            const char *lf = newline(ptr, end, eol);
+            if (lf == nullptr) break;
+            if (!expect.matches(ptr, lf - ptr)) {
+                fail(chunk, ptr, lf + 1 - ptr, expect);
+                return;
+            }
+            ptr = lf + 1;
+            expect.next();
+            lines++;
+        }
+        // The stream can end in the middle of a line, as with --bytes
+        if (ptr < end) {
+            uint32_t explen;
+            const char *exptext = expect.text(explen);
+            uint32_t size = end - ptr;
+            if ((size > explen) || (::memcmp(ptr, exptext, size) != 0)) {
+                fail(chunk, ptr, size, expect);
+            }
         }
     }
 };
 
-int main() {
-    State state;
-    uint32_t fd = fileno(stdin);
-    Buffer buffer(1024 * 1024);
-    while (true) {
-        // read
-        ssize_t nb = ::read(fd, buffer.writeptr(), buffer.avail());
-        // fprintf(stderr, "Got %ld bytes", nb);
-        if (nb > 0) {
-            buffer.commit(nb);
-            uint32_t nbytes = state.process(buffer.readptr(), buffer.size());
-            buffer.advance(nbytes);
-        } else if (nb < 0) {
-            perror("read");
-            break;
+static volatile sig_atomic_t interrupted = 0;
+
+static void onsignal(int) {
+    interrupted = 1;
+}
+
+int main(int argc, char *argv[]) {
+    uint32_t numthreads = std::max(1U, std::thread::hardware_concurrency());
+    uint128_t from = 1;
+    uint64_t maxbytes = std::numeric_limits<uint64_t>::max();
+    std::vector<Rule> list = Rules().rules;
+    Format format;
+    for (int j = 1; j < argc; ++j) {
+        if ((::strcmp(argv[j], "--from") == 0) && (j + 1 < argc)) {
+            from = strtou128(argv[++j]);
+        } else if ((::strcmp(argv[j], "--bytes") == 0) && (j + 1 < argc)) {
+            maxbytes = std::strtoull(argv[++j], nullptr, 10);
+        } else if ((::strcmp(argv[j], "--rules") == 0) && (j + 1 < argc)) {
+            if (!Rules::parse(argv[++j], list)) return 1;
+        } else if ((::strcmp(argv[j], "--separator") == 0) && (j + 1 < argc)) {
+            format.separator = Format::separatorText(argv[++j]);
+        } else if ((::strcmp(argv[j], "--width") == 0) && (j + 1 < argc)) {
+            format.width = std::atoi(argv[++j]);
+        } else if ((::strcmp(argv[j], "--radix") == 0) && (j + 1 < argc)) {
+            format.radix = std::atoi(argv[++j]);
+        } else if (::strcmp(argv[j], "--numbered") == 0) {
+            format.delimiter = ":";
+        } else if (::strcmp(argv[j], "--csv") == 0) {
+            format.delimiter = ",";
+        } else if (::isdigit(argv[j][0])) {
+            numthreads = std::max(1, ::atoi(argv[j]));
+        } else {
+            printf(
+                "Usage: testread [numthreads] [--from N] [--bytes K] [--rules 3:Fizz,5:Buzz,...]\n"
+                "                [--separator lf|crlf|nul|text] [--numbered|--csv] [--width W] [--radix 8|10|16]\n"
+                "                < stream\n");
+            return 0;
+        }
+    }
+    if (!Rules::valid(list, format)) return 1;
+    Rules rules(list, format);
+    if (from == 0) from = 1;
+
+    // Ctrl-C still prints the summary of what was checked so far
+    struct sigaction sa;
+    ::memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = onsignal;
+    ::sigaction(SIGINT, &sa, nullptr);
+    ::sigaction(SIGTERM, &sa, nullptr);
+
+    int fd = fileno(stdin);
+    ::fcntl(fd, F_SETPIPE_SZ, getmaxpipe());
+
+    std::atomic<uint64_t> badoffset{std::numeric_limits<uint64_t>::max()};
+    std::vector<std::unique_ptr<Checker>> checkers;
+    std::vector<std::thread> threads;
+    for (uint32_t j = 0; j < numthreads; ++j) {
+        checkers.emplace_back(new Checker(rules, from, badoffset));
+        threads.emplace_back(&Checker::run, checkers.back().get());
+    }
+
+    // Reads straight into the chunks, only the partial line at the end of each one is copied over
+    char carry[64];
+    uint32_t carried = 0;
+    uint64_t pos = 0;
+    bool eof = false;
+    bool error = false;
+    std::chrono::steady_clock::time_point t0;
+    for (uint32_t next = 0; !eof && !interrupted && (badoffset.load() == std::numeric_limits<uint64_t>::max());
+         next = (next + 1) % numthreads) {
+        Checker &checker(*checkers[next]);
+        Chunk *chunk;
+        Backoff backoff;
+        while (!checker.empty.pop(chunk)) backoff.pause();
+        ::memcpy(chunk->data, carry, carried);
+        uint32_t used = carried;
+        while ((used < CHUNKSIZE) && (pos + used < maxbytes)) {
+            ssize_t nb = ::read(fd, chunk->data + used, std::min<uint64_t>(CHUNKSIZE - used, maxbytes - pos - used));
+            if (nb > 0) {
+                if (pos + used == 0) t0 = std::chrono::steady_clock::now();
+                used += nb;
+            } else if (nb == 0) {
+                eof = true;
+                break;
+            } else if (errno != EINTR) {
+                perror("read");
+                error = eof = true;
+                break;
+            } else if (interrupted) {
+                break;
+            }
+        }
+        if (pos + used >= maxbytes) eof = true;
+        chunk->size = used;
+        carried = 0;
+        if (!eof && !interrupted) {
+            const char *last = (const char *)::memrchr(chunk->data, rules.format.terminator(), used);
+            uint32_t tail = last != nullptr ? chunk->data + used - (last + 1) : used;
+            if (tail < sizeof(carry)) {
+                carried = tail;
+                chunk->size = used - tail;
+                ::memcpy(carry, chunk->data + chunk->size, carried);
+            }
         }
+        chunk->pos = pos;
+        pos += chunk->size;
+        checker.ready.push(chunk);
+    }
+    for (auto &checker : checkers) checker->ready.push(nullptr);
+    for (std::thread &th : threads) th.join();
+    double elapsed = pos > 0 ? std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count() : 0;
+
+    uint64_t lines = 0;
+    const Mismatch *first = nullptr;
+    for (auto &checker : checkers) {
+        lines += checker->lines;
+        if ((first == nullptr) || (checker->mismatch.offset < first->offset)) first = &checker->mismatch;
+    }
+    printf("Bytes:%lu Lines:%lu Threads:%u Seconds:%.3f GB/s:%.3f\n", pos, lines, numthreads, elapsed,
+           elapsed > 0 ? pos / elapsed / 1E9 : 0.0);
+    if (first->offset != std::numeric_limits<uint64_t>::max()) {
+        fprintf(stderr, "Mismatch at byte %lu line %s: expected [%s] got [%s]\n", first->offset,
+                tostring(first->line).c_str(), first->expected, first->got);
+        return 1;
     }
-}
\ No newline at end of file
+    return error ? 1 : 0;
+}
@@ -0,0 +1,122 @@
+#include <cstdio>
+#include <iostream>
+#include <vector>
+#include <string.h>
+#include "Checkpoint.h"
+#include "NumericUtils.h"
+#include "MemUtils.h"
+#include "Rules.h"
+#include "Template.h"
+
+// The standard rules have to agree with the compile time formulas
+void teststandard() {
+    Rules rules;
+    for (uint32_t j = 1; j <= MAXTEMPLATEDIGITS; ++j) {
+        if (rules.blockSize(j) != blockSize(j)) fprintf(stderr, "Error blocksize digits:%d\n", j);
+    }
+    for (uint64_t line = 1; line < 10000000ULL; line += 7) {
+        if (rules.lineOffset(line) != lineOffset(line)) fprintf(stderr, "Error lineoffset line:%ld\n", line);
+        if (rules.offsetLine(1, line * 3) != offsetLine(line * 3)) fprintf(stderr, "Error offsetline:%ld\n", line * 3);
+    }
+    for (uint32_t j = 1; j < MAXOFFSETDIGITS; ++j) {
+        uint64_t line = ipow10(j) - 3;
+        if (rules.lineOffset(line) != lineOffset(line)) fprintf(stderr, "Error lineoffset line:%ld\n", line);
+    }
+}
+
+// Walks the bank from base comparing every block with vanilla and the offsets, relative to base, with the block sizes
+void walk(const Rules &rules, uint128_t base, uint32_t count) {
+    RuleBank bank(rules);
+    std::vector<char> buffer(rules.blockSize(rules.format.maxWidth()) + 1);
+    std::vector<char> expected(buffer.size());
+    const uint128_t origin = base;
+    uint64_t offset = 0;
+    bank.seek(base);
+    uint32_t delta = 0;
+    for (uint32_t j = 0; j < count; ++j) {
+        uint32_t size = bank.incfill(delta, buffer.data());
+        uint32_t realsize = vanilla(rules, base, expected.data());
+        std::string text = tostring(base);
+        if ((realsize != size) || (::memcmp(expected.data(), buffer.data(), size) != 0)) {
+            fprintf(stderr, "Error period:%d base:%s real:%d got:%d\n", rules.period, text.c_str(), realsize, size);
+            dump((uint8_t *)buffer.data(), size);
+            return;
+        }
+        if (rules.rangeBytes(base, base + rules.period - 1) != size) {
+            fprintf(stderr, "Error period:%d base:%s rangebytes\n", rules.period, text.c_str());
+        }
+        if ((rules.lineOffset(base) - rules.lineOffset(origin) != offset) ||
+            (rules.offsetLine(origin, offset + size - 1) != base + rules.period - 1)) {
+            fprintf(stderr, "Error period:%d base:%s offset:%ld\n", rules.period, text.c_str(), offset);
+        }
+        offset += size;
+        delta = (j % 5 == 4) ? rules.period * 3 : rules.period;
+        if (delta > rules.period) offset = rules.lineOffset(base + delta) - rules.lineOffset(origin);
+        base += delta;
+    }
+}
+
+// A checkpoint saved after any number of bytes has to point at the line and the byte within it that come next
+void testcheckpoint(const Rules &rules, uint128_t origin, uint32_t skip) {
+    const char *path = "testrules.ckpt";
+    Checkpoint checkpoint;
+    checkpoint.start(origin, skip, rules.maxLine(), std::numeric_limits<uint64_t>::max(), rules);
+    for (uint64_t delivered = 0; delivered < 100000; delivered = delivered * 3 + 7) {
+        checkpoint.progress.delivered.store(delivered);
+        Checkpoint loaded;
+        if (!checkpoint.save(path, rules) || !loaded.load(path)) return;
+        uint64_t pos = uint64_t(rules.lineOffset(loaded.line) - rules.lineOffset(origin)) + loaded.skip;
+        if ((pos != skip + delivered) || (loaded.skip >= rules.lineSize(loaded.line)) ||
+            (loaded.bytes != delivered) || (loaded.layout != rules.fingerprint())) {
+            std::string text = tostring(origin);
+            fprintf(stderr, "Error period:%d checkpoint:%s+%ld\n", rules.period, text.c_str(), delivered);
+        }
+    }
+    ::unlink(path);
+}
+
+int main() {
+    teststandard();
+    const char *specs[] = {"3:Fizz,5:Buzz", "3:Fizz,5:Buzz,7:Bazz", "2:Even",
+                           "1:All",         "4:Foo,6:Bar",          "7:L33t,11:Eleven"};
+    std::vector<Format> formats(6);
+    formats[1].separator = "\r\n";
+    formats[1].delimiter = ":";
+    formats[2].separator = std::string(1, '\0');
+    formats[2].delimiter = ",";
+    formats[3].width = 19;
+    formats[4].radix = 16;
+    formats[5].radix = 8;
+    formats[5].delimiter = ":";
+    for (const char *spec : specs) {
+        std::vector<Rule> list;
+        if (!Rules::parse(spec, list)) return 1;
+        for (const Format &format : formats) {
+            if (!Rules::valid(list, format)) return 1;
+            Rules rules(list, format);
+            walk(rules, 1, 50000);
+            // Across every change of width up to 128 bits, or up to the fixed width, and at the last number
+            uint64_t span = 20 * rules.period;
+            uint32_t widest = format.width > 0 ? format.width : rules.powers.size();
+            for (uint32_t j = 2; j < widest; ++j) {
+                uint128_t power = rules.powers[j];
+                walk(rules, power > span ? rules.blockBase(power - span) : 1, 300);
+            }
+            if (format.width == 0) walk(rules, rules.blockBase(rules.maxLine()) - 2 * rules.period, 3);
+            testcheckpoint(rules, 1, 0);
+            testcheckpoint(rules, rules.powers[rules.numDigits(rules.period) + 1] - 2, 1);
+        }
+    }
+    // These are reported on stderr as they are rejected
+    const char *invalid[] = {"3", "0:Zero", "3:", "x:Fizz", "65537:Big", "256:A,257:B"};
+    for (const char *spec : invalid) {
+        std::vector<Rule> list;
+        if (Rules::parse(spec, list)) fprintf(stderr, "Error [%s] should not parse\n", spec);
+    }
+    Format narrow;
+    narrow.width = 4;
+    if (Rules::valid(Rules().rules, narrow)) fprintf(stderr, "Error FizzBuzz should not fit 4 characters\n");
+    Format binary;
+    binary.radix = 2;
+    if (Rules::valid(Rules().rules, binary)) fprintf(stderr, "Error base 2 should be rejected\n");
+}
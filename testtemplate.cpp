@@ -0,0 +1,55 @@
+#include <cstdio>
+#include <iostream>
+#include <string.h>
+#include "NumericUtils.h"
+#include "MemUtils.h"
+#include "Template.h"
+
+TemplateBank bank;
+
+// Does not compile if building a bank needs any code to run at startup
+static constexpr TemplateBank pristine;
+static_assert(pristine.ndigits == 0, "A fresh bank must start from scratch");
+
+// Compares the block produced by the bank against vanilla
+void test(uint128_t base, uint32_t size, const char *buffer) {
+    char expected[512];
+    uint32_t realsize = vanilla(base, expected);
+    if ((realsize != size) || (::memcmp(expected, buffer, size) != 0)) {
+        fprintf(stderr, "Error base:%s real:%d got:%d\n", tostring(base).c_str(), realsize, size);
+        dump((uint8_t *)buffer, size);
+    }
+}
+
+// Walks from base with a given increment, mixing in some jumps
+void walk(uint128_t base, uint32_t delta, uint32_t count) {
+    char buffer[512];
+    bank.seek(base);
+    uint32_t size = bank.incfill(0, buffer);
+    test(base, size, buffer);
+    for (uint32_t j = 0; j < count; ++j) {
+        uint32_t step = (j % 7 == 6) ? 15 * (j + 1) : delta;
+        base += step;
+        size = bank.incfill(step, buffer);
+        test(base, size, buffer);
+    }
+}
+
+int main() {
+    walk(1, 15, 10000000);
+    for (uint32_t j = 2; j < 19; ++j) {
+        uint64_t pow10 = ipow10(j);
+        uint64_t start = pow10 > 1000000 ? ((pow10 - 1000000) / 15) * 15 + 1 : 1;
+        walk(start, 15, 70000);
+        walk(start, 15 * 3, 30000);
+        walk(start, 15 * 1021, 100);
+    }
+    // Past 64 bits, up to the last block of 128 bits
+    uint128_t pow10 = ipow10(19);
+    for (uint32_t j = 19; j < MAXWIDEDIGITS; ++j) {
+        walk((pow10 - 10000) / 15 * 15 + 1, 15, 2000);
+        walk((pow10 - 10000) / 15 * 15 + 1, 15 * 7, 100);
+        pow10 *= 10;
+    }
+    walk(UINT128MAX - 15 * 6 + 1, 15, 5);
+}